@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+struct CommandCost {
+    std::string command;
+    uint64_t pssByteSeconds;
+};
+
+// Compact summary of a run, as stored in a baseline file.
+struct RunSummary {
+    uint64_t wallMs;
+    uint64_t userMs;
+    uint64_t sysMs;
+    uint64_t maxPss;
+    uint64_t pssByteSeconds;
+    uint64_t numProcs;
+    std::vector<CommandCost> topCommands;
+};
+
+// Append the run to the baseline file. Saving several runs into the same file
+// lets the comparison account for run-to-run noise.
+void SaveBaseline(const char *path, const RunSummary &summary);
+
+// Compare the run against the runs stored in the baseline file, with the
+// allowed regressions given as "walltime=5%,pss=10%". Prints a per-metric
+// table and returns false on regression. Exits with EXIT_FAILURE if the file
+// cannot be read, holds no run or cannot be parsed.
+bool CompareBaseline(const char *path, const RunSummary &summary, const char *maxRegress);
@@ -0,0 +1,19 @@
+#pragma once
+
+#include "trace.h"
+
+// Export the cost of the process tree as folded stacks ("make;sh;gcc;cc1plus 1234"),
+// one line per ancestry path, for flamegraph.pl. PSS is integrated over time in
+// byte-seconds, CPU time (user + kernel) is in milliseconds, read once more on exit
+// and completed from the children time of the parents. Either path may be null.
+void WriteFoldedStacks(const Trace &trace, const char *pssPath, const char *cpuPath);
+
+class FoldedStacksSink : public TraceSink {
+public:
+    FoldedStacksSink(const char *pssPath, const char *cpuPath) : pssPath(pssPath), cpuPath(cpuPath) {}
+    void Write(const Trace &trace) override;
+
+private:
+    const char *pssPath;
+    const char *cpuPath;
+};
@@ -1,4 +1,37 @@
 #pragma once
 
-int InitNetlink();
-void ReadFromNetlink(int netlink_socket);
\ No newline at end of file
+#include <stdint.h>
+#include <atomic>
+#include <thread>
+
+#include "router.h"
+#include "source.h"
+
+// One proc connector socket, and the thread reading it, shared by every Tracer
+// of the process. Netlink ingestion runs on its own thread which only routes
+// events to the subscription owning the tree of their process.
+class NetlinkSource : public ProcessEventSource {
+public:
+    NetlinkSource();
+    ~NetlinkSource();
+    NetlinkSource(const NetlinkSource &) = delete;
+    NetlinkSource &operator=(const NetlinkSource &) = delete;
+
+    Subscription *Subscribe() override;
+    void Unsubscribe(Subscription *subscription) override;
+    void AddRoot(Subscription *subscription, int pid) override;
+
+    // Number of times the kernel reported it dropped events (ENOBUFS).
+    uint64_t Overruns() const override;
+
+private:
+    void ReaderLoop();
+    void ReadFromNetlink();
+
+    int netlinkSocket = -1;
+    int stopFd = -1;
+    std::atomic<bool> stop{false};
+    std::thread reader;
+    std::atomic<uint64_t> kernelOverruns{0};
+    EventRouter router{"netlink -> aggregator"};
+};
@@ -2,5 +2,20 @@
 
 #include <stdint.h>
 
+#include "baseline.h"
+#include "trace.h"
+
 void InitOutput();
-void GenerateOutputs(int pid, uint64_t startTimeMs);
+// Print the report of the trace on stdout: summary and charts.
+RunSummary GenerateOutputs(const Trace &trace);
+
+// Prints the report when the trace is done, and keeps its summary for the
+// baseline.
+class ReportSink : public TraceSink {
+public:
+    void Write(const Trace &trace) override;
+    const RunSummary &Summary() const;
+
+private:
+    RunSummary summary{};
+};
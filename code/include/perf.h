@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+
+// Software counters only, so no PMU hardware is needed (VMs, containers).
+enum PerfCounter {
+    PERF_TASK_CLOCK,
+    PERF_CONTEXT_SWITCHES,
+    PERF_CPU_MIGRATIONS,
+    PERF_PAGE_FAULTS,
+    PERF_COUNT
+};
+
+// Value already scaled by time enabled / time running.
+struct PerfValue {
+    PerfCounter counter;
+    uint64_t value;
+};
+
+const char *PerfName(PerfCounter counter);
+
+// Inherited counters of one process tree.
+class PerfCounters {
+public:
+    PerfCounters() = default;
+    ~PerfCounters();
+    PerfCounters(const PerfCounters &) = delete;
+    PerfCounters &operator=(const PerfCounters &) = delete;
+
+    // Open inherited counters on pid, which must not have exec'd yet. They start
+    // counting at exec and include every descendant. Returns false if perf events
+    // are not available.
+    bool Open(int pid);
+    bool IsOpen() const;
+    // Counters of the whole tree: live descendants and the ones which exited.
+    bool Read(PerfCounter counter, uint64_t *value) const;
+    void Close();
+
+private:
+    int fds[PERF_COUNT] = {-1, -1, -1, -1};
+    // Set once all fds are open, read by the sampler thread.
+    std::atomic<bool> open{false};
+};
@@ -2,8 +2,114 @@
 
 #include <cstdint>
 #include <string>
+#include <unordered_map>
 
-std::string GetCmdline(int pid);
+struct IoCounters {
+    uint64_t rchar;
+    uint64_t wchar;
+    uint64_t syscr;
+    uint64_t syscw;
+    uint64_t readBytes;
+    uint64_t writeBytes;
+};
+
+// Subset of /proc/PID/stat, times in milliseconds.
+struct ProcStat {
+    char state; // R (runnable), S (sleeping), D (disk wait)...
+    uint64_t minorFaults;
+    uint64_t majorFaults;
+    uint64_t userMs;
+    uint64_t sysMs;
+    uint64_t childrenMs; // User + kernel time of the reaped children, and of theirs
+    uint64_t numThreads;
+};
+
+enum PsiResource {
+    PSI_MEMORY,
+    PSI_CPU,
+    PSI_IO,
+    PSI_COUNT
+};
+
+// Cumulative stall time from the "total=" fields of a pressure file.
+struct Pressure {
+    uint64_t someUs;
+    uint64_t fullUs;
+};
+
+// What a mapping of /proc/PID/smaps is used for.
+enum MappingClass {
+    MAP_HEAP,      // [heap]
+    MAP_STACK,     // [stack]
+    MAP_ANON,      // Private anonymous mmap, and the other [...] mappings
+    MAP_CODE,      // Executable file-backed mappings: the binary and its shared libraries
+    MAP_FILE_DATA, // Other file-backed mappings
+    MAP_SHMEM,     // Shared anonymous, /dev/shm, SysV and memfd mappings
+    MAP_CLASS_COUNT
+};
+
+// Bytes, summed over the mappings of a class.
+struct MappingUsage {
+    uint64_t pss;
+    uint64_t privateDirty;
+    uint64_t swap;
+};
+
+struct SmapsBreakdown {
+    MappingUsage classes[MAP_CLASS_COUNT];
+};
+
+// pid -> cmdline, filled as processes fork and exec: they are gone by the time
+// the trace is reported.
+using CmdlineCache = std::unordered_map<int, std::string>;
+
+// Uncached, empty if the process is gone.
+std::string ReadCmdline(int pid);
+// Basename of argv[0], used to group processes by command. Only looks at the cache.
+std::string GetCommand(const CmdlineCache &cache, int pid);
 uint64_t GetPSS(int pid);
-void Declare(int pid, const std::string& cmdline);
+void Declare(CmdlineCache &cache, int pid, const std::string& cmdline);
+
+// /proc/PID/io is kept open for the lifetime of the process and re-read with pread.
+int OpenIo(int pid);
+bool ReadIo(int fd, IoCounters *counters);
+
+// /proc/PID/stat, same as /proc/PID/io.
+int OpenStat(int pid);
+bool ReadStat(int fd, ProcStat *stat);
+
+// /proc/PID/smaps, same as /proc/PID/io. ReadSmaps() parses the file in place
+// from a fixed buffer, without allocating, so it can run on every tick.
+// /proc/PID/smaps_rollup parses the same, as a single anonymous mapping: the
+// kernel sums the mappings without formatting each one, so it is the cheap way
+// to the PSS total. OpenSmapsRollup() falls back to smaps on kernels without it.
+const char *MappingClassName(MappingClass mapping);
+int OpenSmaps(int pid);
+int OpenSmapsRollup(int pid);
+bool ReadSmaps(int fd, SmapsBreakdown *breakdown);
+
+// /proc/pressure/{memory,cpu,io}, or the *.pressure files of our own cgroup v2.
+const char *PsiName(PsiResource resource);
+int OpenPressure(PsiResource resource, bool cgroup);
+bool ReadPressure(int fd, Pressure *pressure);
+
+// Where the tracer and the sampler get the files of a process from, so the
+// engine can run on something else than the live /proc (see SyntheticSource).
+// Only opening is abstracted: the Read*() functions above parse any fd which
+// supports pread.
+class ProcReader {
+public:
+    virtual ~ProcReader() = default;
+    virtual std::string ReadCmdline(int pid) = 0;
+    virtual int OpenIo(int pid) = 0;
+    virtual int OpenStat(int pid) = 0;
+    virtual int OpenSmaps(int pid) = 0;
+    virtual int OpenSmapsRollup(int pid) = 0;
+    virtual int OpenPressure(PsiResource resource, bool cgroup) = 0;
+};
+
+// The live /proc, through the functions above.
+ProcReader &SystemProc();
 
+std::string GetCmdline(CmdlineCache &cache, ProcReader &proc, int pid);
+uint64_t GetPSS(ProcReader &proc, int pid);
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+struct QueueStats {
+    const char *name;
+    uint64_t pushed;
+    uint64_t maxDepth;
+    uint64_t backpressure; // Pushes which found the queue full and had to wait
+    uint64_t dropped;      // Pushes which found the queue full and gave up
+};
+
+// Bounded lock-free single-producer/single-consumer ring buffer.
+//
+// The consumer sleeps on NotifyFd() (an eventfd, e.g. in an epoll set). The
+// producer only writes to it when the consumer may have seen the queue empty,
+// so a busy queue costs no syscall per element.
+template<typename T, size_t N>
+class SpscQueue {
+    static_assert((N & (N - 1)) == 0, "Capacity must be a power of two");
+
+public:
+    explicit SpscQueue(const char *name) : name(name) {
+        notifyFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (notifyFd == -1) {
+            perror("Cannot create eventfd");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    ~SpscQueue() {
+        close(notifyFd);
+    }
+
+    SpscQueue(const SpscQueue &) = delete;
+    SpscQueue &operator=(const SpscQueue &) = delete;
+
+    int NotifyFd() const {
+        return notifyFd;
+    }
+
+    // Producer side. Gives up and counts a drop if the queue is full.
+    bool TryPush(const T &value) {
+        uint64_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == N) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        Publish(t, value);
+        return true;
+    }
+
+    // Producer side. Waits for the consumer if the queue is full.
+    void Push(const T &value) {
+        Push(value, sched_yield);
+    }
+
+    // Same, calling whileFull() in the meantime: a producer which is also the
+    // consumer of a queue going the other way must keep draining it, or both
+    // threads could end up waiting on each other.
+    template<typename F>
+    void Push(const T &value, F whileFull) {
+        uint64_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == N) {
+            backpressure.fetch_add(1, std::memory_order_relaxed);
+            while (t - head.load(std::memory_order_acquire) == N) {
+                whileFull();
+            }
+        }
+        Publish(t, value);
+    }
+
+    // Producer side. Waits for the consumer if the queue is full, but gives up
+    // and counts a drop once abandoned() returns true.
+    template<typename F>
+    bool PushUnless(const T &value, F abandoned) {
+        uint64_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == N) {
+            backpressure.fetch_add(1, std::memory_order_relaxed);
+            while (t - head.load(std::memory_order_acquire) == N) {
+                if (abandoned()) {
+                    dropped.fetch_add(1, std::memory_order_relaxed);
+                    return false;
+                }
+                sched_yield();
+            }
+        }
+        Publish(t, value);
+        return true;
+    }
+
+    // Consumer side.
+    bool Pop(T *value) {
+        uint64_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_seq_cst)) {
+            return false;
+        }
+        *value = ring[h & (N - 1)];
+        head.store(h + 1, std::memory_order_seq_cst);
+        return true;
+    }
+
+    // Consumer side, to be called before draining the queue after a wake-up.
+    void ClearNotify() {
+        uint64_t count;
+        while (read(notifyFd, &count, sizeof(count)) == sizeof(count)) {}
+    }
+
+    QueueStats Stats() const {
+        return {name,
+                tail.load(std::memory_order_relaxed),
+                maxDepth.load(std::memory_order_relaxed),
+                backpressure.load(std::memory_order_relaxed),
+                dropped.load(std::memory_order_relaxed)};
+    }
+
+private:
+    void Publish(uint64_t t, const T &value) {
+        ring[t & (N - 1)] = value;
+        tail.store(t + 1, std::memory_order_seq_cst);
+
+        // Either the consumer sees the new tail in Pop(), or we see that it
+        // caught up with everything before it and wake it up.
+        uint64_t h = head.load(std::memory_order_seq_cst);
+        if (h == t) {
+            uint64_t one = 1;
+            if (write(notifyFd, &one, sizeof(one)) != sizeof(one)) {
+                perror("Cannot notify queue");
+            }
+        }
+        if (t + 1 - h > maxDepth.load(std::memory_order_relaxed)) {
+            maxDepth.store(t + 1 - h, std::memory_order_relaxed);
+        }
+    }
+
+    const char *name;
+    int notifyFd;
+    T ring[N];
+    alignas(64) std::atomic<uint64_t> head{0};
+    alignas(64) std::atomic<uint64_t> tail{0};
+    alignas(64) std::atomic<uint64_t> maxDepth{0};
+    std::atomic<uint64_t> backpressure{0};
+    std::atomic<uint64_t> dropped{0};
+};
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <linux/cn_proc.h>
+
+#include "source.h"
+
+// The subscriptions of an event source, and which one owns the tree of each
+// process. Sources feed it every event they see and it delivers each to the
+// owner of its process, if any.
+class EventRouter {
+public:
+    using Subscription = ProcessEventSource::Subscription;
+
+    // Subscription queues are named "<source> -> aggregator".
+    explicit EventRouter(const char *queueName) : queueName(queueName) {}
+
+    Subscription *Subscribe();
+    void Unsubscribe(Subscription *subscription);
+    void AddRoot(Subscription *subscription, int pid);
+    // True once every subscription is gone.
+    bool Empty();
+
+    // Never call it with a lock Unsubscribe() needs.
+    void Route(const proc_event &event);
+
+private:
+    const char *queueName;
+    // Taken to route each event, and by subscribers to change routes. Events
+    // are delivered after it is released, holding a reference so the
+    // subscription outlives the delivery.
+    std::mutex mutex;
+    std::vector<std::shared_ptr<Subscription>> subscriptions;
+    std::unordered_map<int, std::shared_ptr<Subscription>> owners; // tgid -> subscription
+};
@@ -0,0 +1,183 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "perf.h"
+#include "proc.h"
+#include "queue.h"
+#include "track.h"
+
+// Sampling clock. Snapshots run on absolute deadlines, so a slow snapshot
+// delays the next tick instead of shifting all the following ones; ticks it
+// overran are counted as missed.
+static constexpr int kJitterBuckets = 8;
+extern const uint64_t kJitterBucketUs[kJitterBuckets]; // Upper bound of each bucket
+struct ClockStats {
+    uint64_t periodUs;
+    uint64_t ticks;
+    uint64_t missed;
+    uint64_t maxLateUs;
+    uint64_t jitter[kJitterBuckets]; // Ticks per lateness bucket
+};
+
+// Time spent in a hot path of the sampler: calls, and the processes they
+// covered (one per call for Track/Untrack, every tracked one for a snapshot).
+struct HotPath {
+    uint64_t calls;
+    uint64_t processes;
+    uint64_t ns;
+};
+
+struct HotPathStats {
+    HotPath track;
+    HotPath untrack;
+    HotPath snapshot;
+};
+
+// --smaps-breakdown formats every mapping of a process, which takes tens of
+// milliseconds on large address spaces: processes are broken down at a lower
+// rate than the ticks, and their total read from smaps_rollup in between.
+struct BreakdownStats {
+    uint64_t reads;         // Full smaps reads
+    uint64_t deferred;      // Process snapshots read from smaps_rollup instead
+    uint64_t maxReadUs;
+    uint64_t maxEveryTicks; // Longest interval between two breakdowns of a process
+};
+
+struct SamplerOptions {
+    // Event-triggered sampling. Out-of-band samples share the periodic sampler
+    // budget so a fork storm does not turn into a sampling storm.
+    bool triggeredSamples = true;
+    uint64_t burstMs = 0;
+    // Read pressure stall information from our cgroup instead of the whole system.
+    bool pressureFromCgroup = false;
+    // Break the PSS of each process down by mapping class, see BreakdownStats.
+    bool smapsBreakdown = false;
+    // Time the Track/Untrack/SnapshotPss hot paths, for benchmarks.
+    bool timeHotPaths = false;
+};
+
+// The sampler runs on its own thread and does all the /proc reads, so a slow
+// smaps read never delays event handling. It keeps its own copy of the
+// tracked set, updated through a command queue, and hands its samples back
+// through a queue drained by HandleSamples() whenever SamplesFd() is readable.
+// Samples are also drained while the aggregator waits for room in the command
+// queue, since the sampler may itself be waiting for room in the sample queue.
+class Sampler {
+public:
+    // perf may be null, otherwise its counters are read on every tick.
+    Sampler(const SamplerOptions &options, const PerfCounters *perf, ProcReader &proc);
+    ~Sampler();
+    Sampler(const Sampler &) = delete;
+    Sampler &operator=(const Sampler &) = delete;
+
+    void Start();
+    void Stop();
+
+    // Aggregator side.
+    void Track(int pid, int parent);
+    void Untrack(int pid);
+    void RequestSample(int pid, bool burst);
+    int SamplesFd() const;
+    // Called for each sample, from HandleSamples() or from the functions above.
+    void SetSampleHandler(std::function<void(const Event &)> handler);
+    void HandleSamples();
+
+    uint64_t NumTriggeredSamples() const;
+    uint64_t NumThrottledSamples() const;
+    // Valid once Stop() returned.
+    ClockStats GetClockStats() const;
+    HotPathStats GetHotPathStats() const;
+    BreakdownStats GetBreakdownStats() const;
+    QueueStats CommandStats() const;
+    QueueStats OutputStats() const;
+
+private:
+    enum CommandType {
+        TRACK,
+        UNTRACK,
+        SAMPLE,
+        STOP
+    };
+
+    struct Command {
+        CommandType type;
+        int pid;
+        int parent;
+        bool burst;
+        uint64_t timeUs;
+    };
+
+    // Persistent /proc/PID files, so each tick is a pread per file instead of
+    // open/read/close. smaps is only opened for the breakdown.
+    struct ProcFds {
+        int io;
+        int stat;
+        int smaps;
+        int smapsRollup;
+        uint64_t nextBreakdownTick;
+    };
+
+    // Out-of-band samples queued by fork/exec, optionally repeated during a burst.
+    struct PendingSample {
+        int pid;
+        uint64_t dueUs;
+        uint64_t burstEndUs;
+    };
+
+    void Loop();
+    void StartClock();
+    bool ConsumeTick(uint64_t *deadlineUs);
+    void RefillBudget();
+    void SnapshotPss(uint64_t deadlineUs);
+    void SnapshotTriggered();
+    void AddPendingSample(int pid, bool burst, uint64_t now);
+    uint64_t NextTriggeredSampleUs() const;
+    void HandleCommand(const Command &command);
+    void PushCommand(const Command &command);
+    bool ReadSmapsFd(int pid, bool rollup, int *fd, SmapsBreakdown *breakdown);
+    void ScheduleBreakdown(ProcFds *fds, uint64_t tick, uint64_t readUs);
+    void Time(HotPath *path, uint64_t startNs, uint64_t processes);
+
+    const SamplerOptions options;
+    const PerfCounters *perf;
+    ProcReader &proc;
+
+    // aggregator -> sampler: changes to the tracked set and sample requests.
+    SpscQueue<Command, 4096> commands{"aggregator -> sampler"};
+    // sampler -> aggregator: samples, plus fork/exit events so they are ordered
+    // with the samples of their pid.
+    SpscQueue<Event, 65536> samples{"sampler -> aggregator"};
+    std::function<void(const Event &)> sampleHandler;
+    std::thread thread;
+    std::atomic<uint64_t> numTriggeredSamples{0};
+    std::atomic<uint64_t> numThrottledSamples{0};
+
+    // Everything below is only touched by the sampler thread once started.
+
+    std::unordered_map<int, ProcFds> procFds;
+    bool running = true;
+    uint64_t snapshots = 0;
+
+    // Periodic snapshots are driven by a timerfd armed on absolute deadlines.
+    int timerFd = -1;
+    uint64_t firstTickUs = 0;
+    ClockStats clockStats{};
+    HotPathStats hotPaths{};
+    BreakdownStats breakdownStats{};
+
+    // Pressure stall information is system (or cgroup) wide: one file per resource.
+    int pressureFds[PSI_COUNT] = {-1, -1, -1};
+
+    // Sampling budget, counted in /proc/PID/smaps reads. The periodic snapshot
+    // always runs and drains it; triggered samples only run when tokens are left.
+    double sampleTokens;
+    uint64_t lastRefillUs = 0;
+
+    std::vector<PendingSample> pendingSamples;
+};
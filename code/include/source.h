@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+
+#include <linux/cn_proc.h>
+
+#include "queue.h"
+
+// Where a Tracer gets the fork/exec/exit events of its process tree from: the
+// kernel proc connector (NetlinkSource), or a synthetic replay (SyntheticSource).
+// Each subscription gets the events of the process trees it owns, in a queue
+// drained by its aggregator whenever EventsFd() is readable.
+class ProcessEventSource {
+public:
+    class Subscription {
+    public:
+        // Names the queue in the report, e.g. "netlink -> aggregator".
+        explicit Subscription(const char *queueName) : events(queueName) {}
+
+        int EventsFd() const {
+            return events.NotifyFd();
+        }
+
+        // Aggregator side, to be called when EventsFd() is readable.
+        void ClearNotify() {
+            events.ClearNotify();
+        }
+
+        bool Pop(proc_event *event) {
+            return events.Pop(event);
+        }
+
+        QueueStats Stats() const {
+            return events.Stats();
+        }
+
+    private:
+        friend class ProcessEventSource;
+
+        // Events are never dropped here while the subscription is open:
+        // losing a fork or an exit would corrupt the tracked set.
+        SpscQueue<proc_event, 16384> events;
+        std::atomic<bool> closed{false};
+    };
+
+    virtual ~ProcessEventSource() = default;
+
+    virtual Subscription *Subscribe() = 0;
+    // Stops routing events to the subscription and frees it. A delivery
+    // waiting for room in its queue gives up.
+    virtual void Unsubscribe(Subscription *subscription) = 0;
+    // Route the events of pid, and of every process it forks from now on, to
+    // the subscription. Call it before pid gets a chance to fork.
+    virtual void AddRoot(Subscription *subscription, int pid) = 0;
+
+    // Number of times events were lost before reaching the source.
+    virtual uint64_t Overruns() const = 0;
+
+protected:
+    friend class EventRouter;
+
+    // Waits for the aggregator if the subscription queue is full, until the
+    // subscription is closed. Never call it with a lock Unsubscribe() needs.
+    static void Deliver(Subscription *subscription, const proc_event &event) {
+        subscription->events.PushUnless(event, [subscription] { return Closed(subscription); });
+    }
+
+    static void Close(Subscription *subscription) {
+        subscription->closed = true;
+    }
+
+    static bool Closed(const Subscription *subscription) {
+        return subscription->closed;
+    }
+};
@@ -0,0 +1,146 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "proc.h"
+#include "router.h"
+#include "source.h"
+
+// Replays a scenario file instead of the kernel: a made-up process tree, as
+// fast as the tracer drains it, with generated /proc files. It needs no root,
+// so the tracking, sampling and aggregation code can be benchmarked and tested
+// anywhere. Like the kernel, it routes the events of each tree to the tracer
+// which added its root.
+//
+//   # Fake /proc of the processes running NAME: MAPPINGS smaps entries of
+//   # PSS_KB each. The root, pid 1, runs the first program.
+//   program NAME MAPPINGS PSS_KB
+//   # Scripted events, on scenario pids.
+//   fork PARENT CHILD
+//   exec PID NAME
+//   exit PID
+//   # PROCESSES processes forked by random live ones, each exec'ing a random
+//   # program, with at most LIVE of them alive at once.
+//   random PROCESSES LIVE SEED
+//
+// Processes still alive at the end of the scenario exit, the root last.
+class SyntheticSource : public ProcessEventSource, public ProcReader {
+public:
+    explicit SyntheticSource(const char *scenarioPath);
+    ~SyntheticSource();
+    SyntheticSource(const SyntheticSource &) = delete;
+    SyntheticSource &operator=(const SyntheticSource &) = delete;
+
+    int RootPid() const;
+    std::string RootCmdline() const;
+
+    // Replays the scenario on its own thread, once the tracers are attached.
+    // The replay stops early when every subscription is gone.
+    void Start();
+
+    Subscription *Subscribe() override;
+    void Unsubscribe(Subscription *subscription) override;
+    void AddRoot(Subscription *subscription, int pid) override;
+    uint64_t Overruns() const override;
+
+    std::string ReadCmdline(int pid) override;
+    int OpenIo(int pid) override;
+    int OpenStat(int pid) override;
+    int OpenSmaps(int pid) override;
+    int OpenSmapsRollup(int pid) override;
+    int OpenPressure(PsiResource resource, bool cgroup) override;
+
+private:
+    enum StepType {
+        FORK,
+        EXEC,
+        EXIT,
+        RANDOM
+    };
+
+    struct Step {
+        StepType type;
+        int pid;      // Child for a fork, number of processes for random
+        int other;    // Parent for a fork, program for an exec, live limit for random
+        uint32_t seed;
+    };
+
+    // The smaps and smaps_rollup files of the processes running it, and the
+    // size its counters grow with, see ProcessCounters.
+    struct Program {
+        std::string name;
+        int mappings;
+        int pssKb;
+        std::string smaps;
+        std::string smapsRollup;
+    };
+
+    // memfds, -1 until first opened.
+    struct AddressSpace {
+        int smaps = -1;
+        int smapsRollup = -1;
+    };
+
+    // stat and io of a process: they grow with every replay step it lives
+    // through, at the rate of the program it runs. The memfds are rewritten
+    // in place, never shorter, so the fds handed out read the latest values.
+    struct ProcessCounters {
+        int parent;
+        uint64_t lastStep;
+        int statFd = -1;
+        int ioFd = -1;
+        size_t statSize = 0;
+        size_t ioSize = 0;
+        uint64_t minorFaults = 0;
+        uint64_t userTicks = 0;
+        uint64_t sysTicks = 0;
+        uint64_t childrenUserTicks = 0;
+        uint64_t childrenSysTicks = 0;
+        IoCounters io{};
+    };
+
+    void Parse(const char *scenarioPath);
+    void AddProgram(const std::string &name, int mappings, int pssKb);
+    void Replay();
+    void Fork(int parent, int child);
+    void Exec(int pid, int program);
+    void Exit(int pid);
+    int ProgramOf(int pid) const;
+    void DropAddressSpace(int pid);
+    int OpenAddressSpaceFile(int pid, int AddressSpace::*fd, std::string Program::*contents);
+    void NextStep();
+    void Grow(ProcessCounters *process, int program) const;
+    void WriteCounters(int pid, int program, ProcessCounters *process) const;
+    std::string FormatStat(int pid, int program, const ProcessCounters &process) const;
+
+    std::vector<Program> programs;
+    std::vector<Step> steps;
+    int numPids = 2; // Scenario pids are in [1, numPids)
+
+    // pid -> program, -1 once exited, written by the replay thread before the
+    // event which makes it visible to the tracer.
+    std::unique_ptr<std::atomic<int>[]> running;
+    // pid -> memfds of the smaps files of its current address space. Emptied
+    // on exec and exit, so the fds handed out before read empty like the
+    // kernel's, and never reused.
+    std::mutex smapsMutex;
+    std::unordered_map<int, AddressSpace> addressSpaces;
+    // pid -> counters of the live processes. Grown by the replay thread only.
+    std::mutex countersMutex;
+    std::unordered_map<int, ProcessCounters> counters;
+    // Replay thread only.
+    std::vector<int> alive;          // Live processes but the root
+    std::vector<int> alivePositions; // pid -> index in alive, -1 if dead
+    uint64_t step = 0;               // Events replayed so far
+    uint64_t lastRefreshUs = 0;
+
+    EventRouter router{"replay -> aggregator"};
+    std::thread replay;
+};
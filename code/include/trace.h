@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+#include <sys/resource.h>
+
+#include "perf.h"
+#include "proc.h"
+#include "queue.h"
+#include "sampler.h"
+#include "track.h"
+
+// Everything recorded about one process tree, handed to the sinks once the
+// tree exited.
+struct Trace {
+    int pid = 0;
+    std::vector<Event> events;
+    CmdlineCache cmdlines;
+    uint64_t numThreads = 0;
+    uint64_t numProcesses = 0;
+    uint64_t startTimeMs = 0;
+    uint64_t endTimeMs = 0;
+
+    // Root process, as reaped by wait4.
+    int status = 0;
+    struct rusage usage{};
+
+    bool perfAvailable = false;
+    uint64_t perfTotals[PERF_COUNT]{};
+
+    uint64_t triggeredSamples = 0;
+    uint64_t throttledSamples = 0;
+    ClockStats clock{};
+    BreakdownStats breakdown{};
+    std::vector<QueueStats> queues;
+    uint64_t netlinkOverruns = 0;
+
+    // Fork/exec/exit events handled, and the time spent in the sampler hot
+    // paths when SamplerOptions::timeHotPaths is set.
+    uint64_t procEvents = 0;
+    HotPathStats hotPaths{};
+};
+
+// Consumes a finished trace: report, folded stacks, a test harness...
+class TraceSink {
+public:
+    virtual ~TraceSink() = default;
+    virtual void Write(const Trace &trace) = 0;
+};
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <stdint.h>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "perf.h"
+#include "proc.h"
+#include "sampler.h"
+#include "source.h"
+#include "trace.h"
+
+struct TracerOptions {
+    SamplerOptions sampler;
+    // Count scheduler events of the tree with inherited perf counters.
+    bool perfCounters = true;
+    // Where /proc files are read from, the live /proc if null.
+    ProcReader *proc = nullptr;
+};
+
+// Traces one process tree. Tracers hold no shared state besides the event
+// source, so several of them can run at once, each driven by its own thread
+// or all from the same event loop through Fd().
+//
+//   NetlinkSource source;
+//   Tracer tracer(source);
+//   tracer.Start(argv);
+//   while (tracer.Poll(-1)) {}
+//   const Trace &trace = tracer.Stop();
+class Tracer {
+public:
+    explicit Tracer(ProcessEventSource &source, const TracerOptions &options = {});
+    ~Tracer();
+    Tracer(const Tracer &) = delete;
+    Tracer &operator=(const Tracer &) = delete;
+
+    // Called from Poll(), on the thread driving the tracer.
+    std::function<void(int pid, int parent)> onFork;
+    std::function<void(int pid, const std::string &cmdline)> onExec;
+    std::function<void(int pid)> onExit;
+    std::function<void(const Event &event)> onSample;
+
+    // Sinks are handed the trace by Stop(), in the order they were added.
+    void AddSink(TraceSink *sink);
+
+    // Fork and exec argv[0] (null terminated argv) and trace its process tree.
+    // Returns its pid.
+    int Start(char **argv);
+    // Trace the tree of a process started by someone else, which must not
+    // have forked yet. Stop() does not reap it.
+    void Attach(int pid, const std::string &cmdline);
+    // Readable when Poll() has something to do.
+    int Fd() const;
+    // Handle pending events, waiting up to timeoutMs for some (-1: no limit).
+    // Returns false once every process of the tree exited.
+    bool Poll(int timeoutMs);
+    // Reap the root process if we started it, stop sampling and hand the
+    // trace to the sinks. Blocks until the root process exited. A tracer
+    // destroyed without it kills the root it started, and calls no sink.
+    const Trace &Stop();
+
+    const Trace &GetTrace() const;
+    bool Tracked(int pid) const;
+
+private:
+    void Track(int pid, int parent);
+    void Untrack(int pid);
+    void HandleProcEvents();
+    void HandleSamples();
+    void Unsubscribe();
+    void OnFork(const proc_event &ev);
+    void OnExec(const proc_event &ev);
+    void OnExit(const proc_event &ev);
+
+    ProcessEventSource &source;
+    ProcessEventSource::Subscription *subscription; // Null once unsubscribed
+    QueueStats subscriptionStats;
+    const TracerOptions options;
+    ProcReader &proc;
+    PerfCounters perf;
+    std::unique_ptr<Sampler> sampler;
+    int epfd = -1;
+    std::unordered_set<int> trackedPids;
+    std::vector<TraceSink *> sinks;
+    bool running = false;
+    bool spawned = false;
+    Trace trace;
+};
@@ -1,10 +1,22 @@
 #pragma once
 
 #include <stdint.h>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
+#include "perf.h"
+#include "proc.h"
+
 enum EventType {
-    PSS
+    PSS,
+    IO,
+    STAT,
+    PRESSURE,
+    PERF,
+    MAPPING,
+    FORK,
+    EXIT
 };
 
 struct Pss {
@@ -12,26 +24,89 @@ struct Pss {
     uint64_t value;
 };
 
+struct Io {
+    int pid;
+    IoCounters counters;
+};
+
+struct Stat {
+    int pid;
+    ProcStat stat;
+};
+
+struct Psi {
+    PsiResource resource;
+    Pressure pressure;
+};
+
+struct Mapping {
+    int pid;
+    MappingClass mapping;
+    MappingUsage usage;
+};
+
+struct Process {
+    int pid;
+    int parent;
+};
+
 struct Event {
     uint64_t timestamp;
     enum EventType type;
+    // Taken out-of-band (PSS on fork/exec, STAT on exit) instead of by the
+    // periodic snapshot.
+    bool triggered;
+    // Periodic snapshot the sample belongs to, counted from 1; 0 for the other
+    // events. Two snapshots can share a millisecond timestamp.
+    uint64_t tick;
     union {
         Pss pss;
+        Io io;
+        Stat stat;
+        Psi psi;
+        PerfValue perf;
+        Mapping mapping;
+        Process process;
     };
 };
 
-extern std::vector<Event> events;
+// Aggregations over the events of a trace, in the order they were recorded.
+// Combined series have one point per periodic snapshot.
 
+// Combined PSS of all tracked processes over time as (timestamp, bytes).
+std::vector<std::pair<uint64_t, uint64_t>> GetCombinedPss(const std::vector<Event> &events);
+long GetMaxCombinedPss(const std::vector<Event> &events);
+// PSS integrated over time for each process, in byte-seconds.
+std::unordered_map<int, uint64_t> GetPssByteSeconds(const std::vector<Event> &events);
+// rchar+wchar transferred by all tracked processes since the previous snapshot
+// as (timestamp, bytes).
+std::vector<std::pair<uint64_t, uint64_t>> GetCombinedIo(const std::vector<Event> &events);
+// Stall time of the whole system (or cgroup) since the previous sample, as
+// (timestamp, microseconds).
+std::vector<std::pair<uint64_t, uint64_t>> GetStalls(const std::vector<Event> &events,
+                                                     PsiResource resource, bool full);
+// Minor + major page faults of all tracked processes since the previous
+// snapshot, as (timestamp, faults).
+std::vector<std::pair<uint64_t, uint64_t>> GetCombinedFaults(const std::vector<Event> &events);
+// Last fault counters seen for each process, summed.
+std::pair<uint64_t, uint64_t> GetFaultTotals(const std::vector<Event> &events);
 
-void Track(int pid);
-void Untrack(int pid);
-bool Tracked(int pid);
-
-
-long GetMaxCombinedPss();
+// What the tree was doing at one snapshot.
+struct Concurrency {
+    uint64_t timestamp;
+    uint64_t processes; // Alive, forked and not exited yet
+    uint64_t threads;
+    uint64_t runnable;  // Processes in the R state
+};
+std::vector<Concurrency> GetConcurrency(const std::vector<Event> &events);
 
-void IncThreads();
-void IncProcesses();
-uint64_t NumThreads();
-uint64_t NumProcs();
-void SnapshotPss();
+// Combined usage of one class of mappings (--smaps-breakdown) over time, as
+// (timestamp, bytes).
+std::vector<std::pair<uint64_t, uint64_t>> GetCombinedMapping(const std::vector<Event> &events,
+                                                              MappingClass mapping, uint64_t MappingUsage::*field);
+// Increase of an inherited perf counter since the previous sample, as
+// (timestamp, delta).
+std::vector<std::pair<uint64_t, uint64_t>> GetPerfDeltas(const std::vector<Event> &events,
+                                                         PerfCounter counter);
+// Last I/O counters seen for each process, excluding its reaped children.
+std::unordered_map<int, IoCounters> GetIoTotals(const std::vector<Event> &events);
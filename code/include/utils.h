@@ -6,6 +6,8 @@
 #include <sys/resource.h>
 
 uint64_t GetTimeMs();
-uint64_t toMs(struct timeval &val);
+uint64_t GetTimeUs();
+uint64_t GetTimeNs();
+uint64_t toMs(const struct timeval &val);
 void Log(const char *fmt, ...);
 void DropRoot();
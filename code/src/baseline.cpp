@@ -0,0 +1,229 @@
+#include "baseline.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <unordered_map>
+
+// File format, one run per "run" line followed by its top commands:
+//
+//   run walltime=221 user=136 sys=69 pss=127156224 pss-seconds=21 procs=3
+//   cmd 18 cc1plus
+//   cmd 2 ld
+
+struct Metric {
+    const char *name;
+    const char *unit;
+    uint64_t RunSummary::*field;
+};
+
+static const Metric kMetrics[] = {
+        {"walltime",    "ms",   &RunSummary::wallMs},
+        {"user",        "ms",   &RunSummary::userMs},
+        {"sys",         "ms",   &RunSummary::sysMs},
+        {"pss",         "B",    &RunSummary::maxPss},
+        {"pss-seconds", "B.s",  &RunSummary::pssByteSeconds},
+        {"procs",       "",     &RunSummary::numProcs},
+};
+
+// Used when --baseline is given without --max-regress.
+static const char *kDefaultMaxRegress = "walltime=10%,pss=10%";
+
+// A regression must exceed the allowed percentage and this many standard
+// deviations of the baseline runs.
+static constexpr double kNoiseSigmas = 3.0;
+
+static constexpr int kMaxCommandsShown = 5;
+
+void SaveBaseline(const char *path, const RunSummary &summary) {
+    FILE *f = fopen(path, "a");
+    if (!f) {
+        perror("Cannot open baseline for writing");
+        exit(EXIT_FAILURE);
+    }
+    fprintf(f, "run");
+    for (const Metric &metric: kMetrics) {
+        fprintf(f, " %s=%zu", metric.name, summary.*metric.field);
+    }
+    fprintf(f, "\n");
+    for (const CommandCost &cost: summary.topCommands) {
+        fprintf(f, "cmd %zu %s\n", cost.pssByteSeconds, cost.command.c_str());
+    }
+    fclose(f);
+}
+
+// A baseline which cannot be compared with is an error, not a regression.
+static void Unusable(const char *path, int lineNumber, const char *error) {
+    if (lineNumber) {
+        fprintf(stderr, "Unusable baseline %s:%d: %s\n", path, lineNumber, error);
+    } else {
+        fprintf(stderr, "Unusable baseline %s: %s\n", path, error);
+    }
+    exit(EXIT_FAILURE);
+}
+
+static std::vector<RunSummary> LoadBaseline(const char *path) {
+    std::vector<RunSummary> runs;
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror("Cannot open baseline");
+        exit(EXIT_FAILURE);
+    }
+
+    char line[4096];
+    int lineNumber = 0;
+    while (fgets(line, sizeof(line), f) != nullptr) {
+        lineNumber++;
+        line[strcspn(line, "\n")] = 0;
+        if (strncmp(line, "run ", 4) == 0) {
+            runs.push_back({});
+            size_t found = 0;
+            for (char *pch = strtok(line + 4, " "); pch; pch = strtok(nullptr, " ")) {
+                char *value = strchr(pch, '=');
+                if (!value) {
+                    Unusable(path, lineNumber, "expected METRIC=VALUE");
+                }
+                *value++ = 0;
+                for (const Metric &metric: kMetrics) {
+                    if (strcmp(metric.name, pch) == 0) {
+                        char *end;
+                        runs.back().*metric.field = strtoull(value, &end, 10);
+                        if (end == value || *end) {
+                            Unusable(path, lineNumber, "metric value is not a number");
+                        }
+                        found++;
+                    }
+                }
+            }
+            if (found != std::size(kMetrics)) {
+                Unusable(path, lineNumber, "run is missing metrics");
+            }
+        } else if (strncmp(line, "cmd ", 4) == 0 && !runs.empty()) {
+            char *command = nullptr;
+            uint64_t pssByteSeconds = strtoull(line + 4, &command, 10);
+            if (!command || *command != ' ') {
+                Unusable(path, lineNumber, "expected 'cmd PSS_SECONDS COMMAND'");
+            }
+            runs.back().topCommands.push_back({command + 1, pssByteSeconds});
+        } else if (line[strspn(line, " \t")] != 0) {
+            Unusable(path, lineNumber, "expected a 'run' line, or its 'cmd' lines");
+        }
+    }
+    fclose(f);
+    if (runs.empty()) {
+        Unusable(path, 0, "no run recorded");
+    }
+    return runs;
+}
+
+// Parse "walltime=5%,pss=10%" into metric name -> allowed fraction.
+static std::unordered_map<std::string, double> ParseMaxRegress(const char *spec) {
+    std::unordered_map<std::string, double> thresholds;
+    std::string copy = spec;
+    for (char *pch = strtok(copy.data(), ","); pch; pch = strtok(nullptr, ",")) {
+        char *value = strchr(pch, '=');
+        if (!value) {
+            fprintf(stderr, "Ignoring malformed regression threshold '%s'\n", pch);
+            continue;
+        }
+        *value++ = 0;
+        bool known = false;
+        for (const Metric &metric: kMetrics) {
+            known |= strcmp(metric.name, pch) == 0;
+        }
+        if (!known) {
+            fprintf(stderr, "Ignoring unknown metric '%s'\n", pch);
+            continue;
+        }
+        thresholds[pch] = strtod(value, nullptr) / 100.0;
+    }
+    return thresholds;
+}
+
+static void MeanAndDeviation(const std::vector<double> &values, double *mean, double *deviation) {
+    *mean = 0;
+    for (double value: values) {
+        *mean += value;
+    }
+    *mean /= values.size();
+
+    *deviation = 0;
+    if (values.size() < 2) {
+        return;
+    }
+    for (double value: values) {
+        *deviation += (value - *mean) * (value - *mean);
+    }
+    *deviation = sqrt(*deviation / (values.size() - 1));
+}
+
+static double Percent(double value, double reference) {
+    return reference == 0 ? 0 : (value - reference) * 100.0 / reference;
+}
+
+// "+12.3%", or ifNoReference when there is nothing to compare with.
+static const char *FormatChange(char *buff, size_t size, double value, double reference,
+                                const char *ifNoReference) {
+    if (reference == 0 && value != 0) {
+        return ifNoReference;
+    }
+    snprintf(buff, size, "%+.1f%%", Percent(value, reference));
+    return buff;
+}
+
+bool CompareBaseline(const char *path, const RunSummary &summary, const char *maxRegress) {
+    std::vector<RunSummary> runs = LoadBaseline(path);
+    auto thresholds = ParseMaxRegress(maxRegress ? maxRegress : kDefaultMaxRegress);
+
+    printf("Baseline: %zu run%s from %s\n", runs.size(), runs.size() > 1 ? "s" : "", path);
+    printf("%-12s %17s %17s %9s %9s  %s\n", "Metric", "Baseline", "Current", "Diff", "Limit", "Status");
+
+    bool ok = true;
+    for (const Metric &metric: kMetrics) {
+        std::vector<double> values;
+        for (const RunSummary &run: runs) {
+            values.push_back(run.*metric.field);
+        }
+        double mean, deviation;
+        MeanAndDeviation(values, &mean, &deviation);
+        double current = summary.*metric.field;
+
+        const char *status = "";
+        char limit[32] = "";
+        if (auto threshold = thresholds.find(metric.name); threshold != thresholds.end()) {
+            double allowed = mean + std::max(mean * threshold->second, kNoiseSigmas * deviation);
+            bool regressed = current > allowed;
+            ok &= !regressed;
+            status = regressed ? "REGRESSION" : "ok";
+            snprintf(limit, sizeof(limit), "%+.1f%%", Percent(allowed, mean));
+        }
+        char change[32];
+        printf("%-12s %'14.0f%-3s %'14.0f%-3s %9s %9s  %s\n", metric.name,
+               mean, metric.unit, current, metric.unit,
+               FormatChange(change, sizeof(change), current, mean, "n/a"), limit, status);
+    }
+
+    // Not gated, but tells where a regression comes from.
+    std::unordered_map<std::string, double> baselineCommands;
+    for (const RunSummary &run: runs) {
+        for (const CommandCost &cost: run.topCommands) {
+            baselineCommands[cost.command] += (double) cost.pssByteSeconds / runs.size();
+        }
+    }
+    int shown = 0;
+    for (const CommandCost &cost: summary.topCommands) {
+        if (shown++ == kMaxCommandsShown) {
+            break;
+        }
+        // A command missing from the baseline is new, not unchanged.
+        double reference = baselineCommands[cost.command];
+        char change[32];
+        printf("  %-10s %'14.0fB.s %'14zuB.s %9s\n", cost.command.c_str(), reference, cost.pssByteSeconds,
+               FormatChange(change, sizeof(change), cost.pssByteSeconds, reference, "new"));
+    }
+
+    return ok;
+}
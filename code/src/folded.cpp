@@ -0,0 +1,196 @@
+#include "folded.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "proc.h"
+
+// Ancestry paths are interned as (parent path, command) nodes, so a path is
+// resolved once per process rather than rebuilt for every sample.
+struct PathNode {
+    uint32_t parent;
+    std::string command;
+};
+
+static constexpr uint32_t kNoPath = UINT32_MAX;
+
+class AncestryPaths {
+public:
+    uint32_t Intern(uint32_t parent, const std::string &command) {
+        auto [it, inserted] = ids.try_emplace({parent, command}, (uint32_t) nodes.size());
+        if (inserted) {
+            nodes.push_back({parent, command});
+        }
+        return it->second;
+    }
+
+    size_t Size() const {
+        return nodes.size();
+    }
+
+    std::string Folded(uint32_t id) const {
+        std::vector<const std::string *> frames;
+        for (; id != kNoPath; id = nodes[id].parent) {
+            frames.push_back(&nodes[id].command);
+        }
+        std::string folded;
+        for (auto frame = frames.rbegin(); frame != frames.rend(); ++frame) {
+            if (!folded.empty()) {
+                folded += ';';
+            }
+            folded += **frame;
+        }
+        return folded;
+    }
+
+private:
+    std::vector<PathNode> nodes;
+    std::map<std::pair<uint32_t, std::string>, uint32_t> ids;
+};
+
+// ';' separates frames and the last ' ' separates the value.
+static std::string FrameName(const CmdlineCache &cmdlines, int pid) {
+    std::string command = GetCommand(cmdlines, pid);
+    std::replace(command.begin(), command.end(), ';', ':');
+    std::replace(command.begin(), command.end(), ' ', '_');
+    return command;
+}
+
+static void Write(const char *path, const AncestryPaths &paths, const std::vector<uint64_t> &values) {
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        perror("Cannot open folded stacks output");
+        exit(EXIT_FAILURE);
+    }
+    std::vector<std::pair<std::string, uint64_t>> lines;
+    for (uint32_t id = 0; id < values.size(); id++) {
+        if (values[id] != 0) {
+            lines.emplace_back(paths.Folded(id), values[id]);
+        }
+    }
+    std::sort(lines.begin(), lines.end());
+    for (const auto &[folded, value]: lines) {
+        fprintf(f, "%s %zu\n", folded.c_str(), value);
+    }
+    fclose(f);
+}
+
+void WriteFoldedStacks(const Trace &trace, const char *pssPath, const char *cpuPath) {
+    struct ProcessState {
+        uint32_t path = kNoPath;
+        int parent = 0;
+        uint64_t lastPssTimestamp = 0;
+        uint64_t lastPss = 0;
+        uint64_t lastCpuMs = 0;
+        uint64_t lastChildrenMs = 0;
+        // Growth of the reaped children time minus the CPU seen in the
+        // children which exited, and the paths of those not fully seen yet.
+        int64_t unseenChildrenMs = 0;
+        std::vector<uint32_t> unseenPaths;
+    };
+
+    AncestryPaths paths;
+    std::unordered_map<int, ProcessState> processes;
+    std::vector<uint64_t> pssByteMs;
+    std::vector<uint64_t> cpuMs;
+
+    auto state = [&](int pid) -> ProcessState & {
+        ProcessState &process = processes[pid];
+        if (process.path == kNoPath) {
+            process.path = paths.Intern(kNoPath, FrameName(trace.cmdlines, pid));
+        }
+        pssByteMs.resize(paths.Size());
+        cpuMs.resize(paths.Size());
+        return process;
+    };
+
+    // A process reaped before its final STAT was read (or before it was ever
+    // sampled) still shows in the children time of its parent: spread what
+    // the children seen did not account for over those which exited.
+    auto bookUnseen = [&](ProcessState &parent) {
+        if (parent.unseenChildrenMs == 0) {
+            parent.unseenPaths.clear(); // Every reaped child was fully seen
+        }
+        if (parent.unseenChildrenMs <= 0 || parent.unseenPaths.empty()) {
+            return;
+        }
+        uint64_t share = parent.unseenChildrenMs / parent.unseenPaths.size();
+        for (uint32_t path: parent.unseenPaths) {
+            cpuMs[path] += share;
+        }
+        cpuMs[parent.unseenPaths[0]] += parent.unseenChildrenMs % parent.unseenPaths.size();
+        parent.unseenChildrenMs = 0;
+        parent.unseenPaths.clear();
+    };
+
+    // A sample holds until the next sample of the same process, or its exit.
+    auto integrate = [&](ProcessState &process, uint64_t timestamp) {
+        if (process.lastPssTimestamp && timestamp > process.lastPssTimestamp) {
+            pssByteMs[process.path] += process.lastPss * (timestamp - process.lastPssTimestamp);
+        }
+    };
+
+    for (const auto &event: trace.events) {
+        switch (event.type) {
+            case FORK: {
+                uint32_t parent = kNoPath;
+                if (auto it = processes.find(event.process.parent); it != processes.end()) {
+                    parent = it->second.path;
+                }
+                processes[event.process.pid] = {paths.Intern(parent, FrameName(trace.cmdlines, event.process.pid)),
+                                                event.process.parent};
+                break;
+            }
+            case PSS: {
+                ProcessState &process = state(event.pss.pid);
+                integrate(process, event.timestamp);
+                process.lastPssTimestamp = event.timestamp;
+                process.lastPss = event.pss.value;
+                break;
+            }
+            case STAT: {
+                ProcessState &process = state(event.stat.pid);
+                uint64_t total = event.stat.stat.userMs + event.stat.stat.sysMs;
+                cpuMs[process.path] += total - std::min(total, process.lastCpuMs);
+                process.lastCpuMs = std::max(total, process.lastCpuMs);
+                uint64_t children = event.stat.stat.childrenMs;
+                process.unseenChildrenMs += children - std::min(children, process.lastChildrenMs);
+                process.lastChildrenMs = std::max(children, process.lastChildrenMs);
+                bookUnseen(process);
+                break;
+            }
+            case EXIT: {
+                ProcessState &process = state(event.process.pid);
+                integrate(process, event.timestamp);
+                process.lastPssTimestamp = 0;
+                if (auto parent = processes.find(process.parent); parent != processes.end()) {
+                    parent->second.unseenChildrenMs -= process.lastCpuMs + process.lastChildrenMs;
+                    parent->second.unseenPaths.push_back(process.path);
+                    bookUnseen(parent->second);
+                }
+                break;
+            }
+            default:
+                break;
+        }
+    }
+
+    if (pssPath) {
+        for (uint64_t &value: pssByteMs) {
+            value /= 1000;
+        }
+        Write(pssPath, paths, pssByteMs);
+    }
+    if (cpuPath) {
+        Write(cpuPath, paths, cpuMs);
+    }
+}
+
+void FoldedStacksSink::Write(const Trace &trace) {
+    WriteFoldedStacks(trace, pssPath, cpuPath);
+}
@@ -1,75 +1,87 @@
 #include "output.h"
 #include "utils.h"
-#include "track.h"
-#include "proc.h"
+#include "tracer.h"
+#include "folded.h"
 #include "netlink.h"
+#include "synthetic.h"
 
 #include <unistd.h>
 #include <cstring>
-
-#include <sys/epoll.h>
+#include <memory>
 
 #ifndef VERSION
 #error "VERSION not defined"
 #endif
 
-static constexpr int kSnapshotEveryMs = 1;
-
-int ForkAndExec(char *cmd, char **parameters, int numParameters) {
-    Log("ForkAndExec %s", cmd);
-    std::string cmdline = std::string();
-    for (int i = 0; i < numParameters; i++) {
-        Log(" %s", parameters[i]);
-        cmdline += " ";
-        cmdline += parameters[i];
-    }
-
-    int pid = fork();
-    if (pid == 0) { // This is the new process
-        // Drop superuser privileges
-        DropRoot();
-
-        // We cannot reuse parameters as it, since it is not null terminated
-        char *argv[numParameters + 1];
-        for (int i = 0; i < numParameters; i++) {
-            argv[i] = parameters[i];
-            Log("execv argv[%d]=%s\n", i, argv[i]);
-        }
-        argv[numParameters] = nullptr;
-
-        Log("execv argv[%d]=%s\n", numParameters, "NULL");
-        int ret = execvp(cmd, argv);
-        if (ret == -1) {
-            Log("Could not execv '%s'", cmd);
-            perror("Unable to execv");
-            exit(EXIT_FAILURE);
-        }
-    } else {
-        Track(pid);
-        // For short-lived process, we may not be quick enough to poll /proc/PID/cmdline.
-        // We cheat and pre-populate the cache here.
-        Declare(pid, cmdline);
-    }
-    return pid;
+// Exit code when the run regressed against --baseline
+static constexpr int kRegressionExitCode = 2;
+
+static void PrintUsage(const char *name) {
+    printf("Usage: %s [--version] [--help] [options] command [args...]\n", name);
+    printf("  --no-event-samples    Only sample PSS periodically, not on fork/exec\n");
+    printf("  --burst-ms N          Keep sampling a new exec at a higher rate for N ms\n");
+    printf("  --save-baseline FILE  Append a summary of this run to FILE\n");
+    printf("  --baseline FILE       Compare this run against FILE, exit with %d on regression\n", kRegressionExitCode);
+    printf("  --max-regress SPEC    Allowed regressions, e.g. walltime=5%%,pss=10%%\n");
+    printf("  --psi-cgroup          Read pressure stall information from ste's cgroup, not the system\n");
+    printf("  --smaps-breakdown     Break PSS down by mapping class (heap, stack, code...)\n");
+    printf("  --folded-pss FILE     Write PSS byte-seconds by process ancestry as folded stacks\n");
+    printf("  --folded-cpu FILE     Write CPU milliseconds by process ancestry as folded stacks\n");
+    printf("  --replay FILE         Trace the synthetic process tree of a scenario file instead of a command\n");
 }
 
 int main(int argc, char **argv) {
-    for (int i = 1; i < argc; i++) {
+    TracerOptions options;
+    const char *saveBaseline = nullptr;
+    const char *baseline = nullptr;
+    const char *maxRegress = nullptr;
+    const char *foldedPss = nullptr;
+    const char *foldedCpu = nullptr;
+    const char *replay = nullptr;
+
+    int cmdIndex = 1;
+    for (; cmdIndex < argc; cmdIndex++) {
         // stop on positional arguments
-        if (argv[i][0] != '-') break;
+        if (argv[cmdIndex][0] != '-') break;
 
-        if (std::strcmp(argv[i], "--version") == 0) {
+        if (std::strcmp(argv[cmdIndex], "--version") == 0) {
             puts(VERSION);
             return 0;
         }
 
-        if (std::strcmp(argv[i], "--help") == 0) {
-            printf("Usage: %s [--version] [--help] command [args...]\n", argv[0]);
+        if (std::strcmp(argv[cmdIndex], "--help") == 0) {
+            PrintUsage(argv[0]);
             return 0;
         }
+
+        if (std::strcmp(argv[cmdIndex], "--no-event-samples") == 0) {
+            options.sampler.triggeredSamples = false;
+        } else if (std::strcmp(argv[cmdIndex], "--burst-ms") == 0 && cmdIndex + 1 < argc) {
+            options.sampler.burstMs = strtoull(argv[++cmdIndex], nullptr, 10);
+        } else if (std::strcmp(argv[cmdIndex], "--save-baseline") == 0 && cmdIndex + 1 < argc) {
+            saveBaseline = argv[++cmdIndex];
+        } else if (std::strcmp(argv[cmdIndex], "--baseline") == 0 && cmdIndex + 1 < argc) {
+            baseline = argv[++cmdIndex];
+        } else if (std::strcmp(argv[cmdIndex], "--max-regress") == 0 && cmdIndex + 1 < argc) {
+            maxRegress = argv[++cmdIndex];
+        } else if (std::strcmp(argv[cmdIndex], "--psi-cgroup") == 0) {
+            options.sampler.pressureFromCgroup = true;
+        } else if (std::strcmp(argv[cmdIndex], "--smaps-breakdown") == 0) {
+            options.sampler.smapsBreakdown = true;
+        } else if (std::strcmp(argv[cmdIndex], "--folded-pss") == 0 && cmdIndex + 1 < argc) {
+            foldedPss = argv[++cmdIndex];
+        } else if (std::strcmp(argv[cmdIndex], "--folded-cpu") == 0 && cmdIndex + 1 < argc) {
+            foldedCpu = argv[++cmdIndex];
+        } else if (std::strcmp(argv[cmdIndex], "--replay") == 0 && cmdIndex + 1 < argc) {
+            replay = argv[++cmdIndex];
+        } else {
+            fprintf(stderr, "Unknown option '%s'\n", argv[cmdIndex]);
+            PrintUsage(argv[0]);
+            return EXIT_FAILURE;
+        }
     }
 
-    if (geteuid() != 0) {
+    if (!replay && geteuid() != 0) {
         fprintf(stderr,"Needs root permission (found %d)\n", geteuid());
         return 0;
     }
@@ -78,80 +90,67 @@ int main(int argc, char **argv) {
         Log("argv[%02d]:%s\n", i, argv[i]);
     }
 
-    if (argc < 2) {
+    if (!replay && cmdIndex >= argc) {
         fprintf(stderr, "No command to trace\n");
         return 0;
     }
 
     InitOutput();
 
-    int netlink_socket = InitNetlink();
-
-    int epfd = epoll_create(1);
-    if (epfd == -1) {
-        perror("Cannot create epoll");
-        exit(EXIT_FAILURE);
+    // A replay runs the same engine on a made-up process tree and /proc, and
+    // reports how fast it went.
+    std::unique_ptr<ProcessEventSource> source;
+    SyntheticSource *synthetic = nullptr;
+    if (replay) {
+        source = std::make_unique<SyntheticSource>(replay);
+        synthetic = (SyntheticSource *) source.get();
+        options.proc = synthetic;
+        options.perfCounters = false;
+        options.sampler.timeHotPaths = true;
+    } else {
+        source = std::make_unique<NetlinkSource>();
     }
 
-    // Prepare epoll
-    struct epoll_event ev{};
-    ev.data.fd = netlink_socket;
-    ev.events = EPOLLIN; // Register for read availability
-    int ctl = epoll_ctl(epfd, EPOLL_CTL_ADD, netlink_socket, &ev);
-    if (ctl) {
-        perror("epoll_ctl error");
-        exit(EXIT_FAILURE);
+    Tracer tracer(*source, options);
+    if (!synthetic) {
+        tracer.onExec = [](int, const std::string &cmdline) {
+            printf("\033[0;31m"); // Draw it in red
+            printf("EXEC");
+            printf("\033[0m");
+            printf(": [%s]\n", cmdline.c_str());
+        };
+    }
+    ReportSink report;
+    tracer.AddSink(&report);
+    FoldedStacksSink folded(foldedPss, foldedCpu);
+    if (foldedPss || foldedCpu) {
+        tracer.AddSink(&folded);
     }
 
-    // From here, we are receiving netlink events. We can create the process we want to observe.
-    // We add the forked process to the list of Tracked processes.
-    uint64_t startTimeMs = GetTimeMs();
-    int pid = ForkAndExec(argv[1], &argv[1], argc - 1);
-
-    int64_t nextMemorySnapshot = GetTimeMs() - kSnapshotEveryMs;
+    // From here, we are receiving process events. We can create the process we want to observe.
+    if (synthetic) {
+        tracer.Attach(synthetic->RootPid(), synthetic->RootCmdline());
+        synthetic->Start();
+    } else {
+        tracer.Start(&argv[cmdIndex]);
+    }
 
     // Let's roll until all processes have run!
-    while (Tracked(pid)) {
-        const int kMaxEvents = 1;
-
-        // Calculate timeout so we snapshot PSS at regular intervals.
-        long timeOut = nextMemorySnapshot - GetTimeMs();
-        if (timeOut < 0) timeOut = 0;
-
-        struct epoll_event evlist[kMaxEvents];
-        int ready = epoll_wait(epfd, evlist, kMaxEvents, timeOut);
-        switch (ready) {
-            case -1 : { // Error?
-                if (errno == EINTR) {
-                    continue;
-                }
-
-                Log("epoll error");
-                exit(EXIT_FAILURE);
-                break;
-            }
-            case 0 : { // Timeout, this is time to snapshop PSS for all processes.
-                SnapshotPss();
-                nextMemorySnapshot = GetTimeMs() + kSnapshotEveryMs;
-                break;
-            }
-            default: {
-                for (int j = 0; j < ready; j++) {
-                    if (evlist[j].events & EPOLLIN) {
-                        ReadFromNetlink(evlist[j].data.fd);
-                    } else if (evlist[j].events & (EPOLLHUP | EPOLLERR)) {
-                        perror("Netlink hangup?\n");
-                        exit(EXIT_FAILURE);
-                    }
-                }
-            }
-        }
+    while (tracer.Poll(-1)) {
     }
-    close(netlink_socket);
 
-    DropRoot();
+    if (!synthetic) {
+        DropRoot();
+    }
 
-    GenerateOutputs(pid, startTimeMs);
+    tracer.Stop();
+    const RunSummary &summary = report.Summary();
+
+    // Compare before saving, so a file can be used as both a rolling baseline and the reference.
+    bool regressed = baseline && !CompareBaseline(baseline, summary, maxRegress);
+    if (saveBaseline) {
+        SaveBaseline(saveBaseline, summary);
+    }
 
-    return EXIT_SUCCESS;
+    return regressed ? kRegressionExitCode : EXIT_SUCCESS;
 }
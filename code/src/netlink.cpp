@@ -1,139 +1,31 @@
 #include "netlink.h"
 
 #include <algorithm>
+#include <atomic>
+#include <cerrno>
 #include <cstdio>
 #include <string>
 #include <cstring>
+#include <thread>
 
 #include <linux/netlink.h>
 #include <linux/cn_proc.h>
 #include <linux/connector.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
-#include "track.h"
 #include "utils.h"
-#include "proc.h"
 
 #define SEND_MESSAGE_LEN (NLMSG_LENGTH(sizeof(struct cn_msg) + sizeof(enum proc_cn_mcast_op)))
 #define RECV_MESSAGE_LEN (NLMSG_LENGTH(sizeof(struct cn_msg) + sizeof(struct proc_event)))
 #define SEND_MESSAGE_SIZE    (NLMSG_SPACE(SEND_MESSAGE_LEN))
 #define RECV_MESSAGE_SIZE    (NLMSG_SPACE(RECV_MESSAGE_LEN))
 
-static int BUFF_SIZE = std::max((int) std::max(SEND_MESSAGE_SIZE, RECV_MESSAGE_SIZE), 1024);
-
-/*     PARENT       CHILD
- *   TGID   PID   TGID   PID
- *
- *    X             B     B       X forked into B
- *    A             A     X       A created thread X
- *
- *    On fork, if TGID tracked, Track child TGID
- *    On thread, if CHILD TGID Tracked, count
- */
-static void OnFork(proc_event *ev) {
-    if (ev->event_data.fork.child_pid !=
-        ev->event_data.fork.child_tgid) {
-
-        // This is a new thread
-        if (Tracked(ev->event_data.fork.child_tgid)) {
-            IncThreads();
-            Log("%s:parent(pid,tgid)=%d,%d\tchild(pid,tgid)=%d,%d\n",
-                "NEW_THREAD ",
-                ev->event_data.fork.parent_pid,
-                ev->event_data.fork.parent_tgid,
-                ev->event_data.fork.child_pid,
-                ev->event_data.fork.child_tgid);
-        }
-    } else {
-        // This is a new process
-        if (Tracked(ev->event_data.fork.parent_tgid) ||
-            Tracked(ev->event_data.fork.child_tgid)) {
-            IncThreads();
-            IncProcesses();
-            Log("%s:parent(pid,tgid)=%d,%d\tchild(pid,tgid)=%d,%d\n",
-                "NEW_PROCESS ",
-                ev->event_data.fork.parent_pid,
-                ev->event_data.fork.parent_tgid,
-                ev->event_data.fork.child_pid,
-                ev->event_data.fork.child_tgid);
-            Track(ev->event_data.fork.child_tgid);
-        }
-    }
-}
-
-
-static void OnExec(proc_event *ev) {
-    int pid = ev->event_data.exec.process_pid;
-    std::string cmdline = GetCmdline(pid);
-//    printf("EXEC:pid=%d,tgid=%d\t[%s]\n",
-//        ev->event_data.exec.process_pid,
-//        ev->event_data.exec.process_tgid,
-//        cmdline.c_str());
-    if (Tracked(pid)) {  
-      printf("\033[0;31m"); // Draw it in red
-      printf("EXEC");
-      printf("\033[0m");
-      printf(": [%s]\n", cmdline.c_str());
-    }
-}
-
-static void OnExit(proc_event *ev) {
-    Log("EXIT:pid=%d, tgid=%d\texit code=%d\n",
-        ev->event_data.exit.process_pid,
-        ev->event_data.exit.process_tgid,
-        ev->event_data.exit.exit_code);
-    Untrack(ev->event_data.exit.process_pid);
-}
-
-static void OnUid(proc_event *ev) {
-    Log("UID:pid=%d,%d ruid=%d,euid=%d\n",
-        ev->event_data.id.process_pid, ev->event_data.id.process_tgid,
-        ev->event_data.id.r.ruid, ev->event_data.id.e.euid);
-}
-
-static void OnGid(proc_event *ev) {
-    Log("gid change: pid=%d tgid=%d from %d to %d\n",
-        ev->event_data.id.process_pid,
-        ev->event_data.id.process_tgid,
-        ev->event_data.id.r.rgid,
-        ev->event_data.id.e.egid);
-}
-
-void HandleMsg(struct cn_msg *cn_hdr) {
-    struct proc_event *ev = (struct proc_event *) cn_hdr->data;
-    switch (ev->what) {
-        case proc_event::PROC_EVENT_NONE:
-            Log("Listen request received\n");
-            break;
-        case proc_event::PROC_EVENT_FORK:
-            OnFork(ev);
-            break;
-        case proc_event::PROC_EVENT_EXEC:
-            OnExec(ev);
-            break;
-        case proc_event::PROC_EVENT_UID:
-            OnUid(ev);
-            break;
-        case proc_event::PROC_EVENT_GID:
-            OnGid(ev);
-            break;
-        case proc_event::PROC_EVENT_EXIT:
-            OnExit(ev);
-            break;
-        case proc_event::PROC_EVENT_SID:
-        case proc_event::PROC_EVENT_PTRACE:
-        case proc_event::PROC_EVENT_COMM:
-        case proc_event::PROC_EVENT_COREDUMP:
-            break;
-        default:
-            Log("Unhandled message %d\n", ev->what);
-            break;
-    }
-}
+static const int BUFF_SIZE = std::max((int) std::max(SEND_MESSAGE_SIZE, RECV_MESSAGE_SIZE), 1024);
 
-
-void ReadFromNetlink(int netlink_socket) {
+void NetlinkSource::ReadFromNetlink() {
     struct sockaddr_nl from_nla{};
     char b[BUFF_SIZE];
 
@@ -147,7 +39,7 @@ void ReadFromNetlink(int netlink_socket) {
     memcpy(&from_nla, &kern_nla, sizeof(from_nla));
 
     socklen_t from_nla_len = sizeof(from_nla);
-    ssize_t bytesReceived = recvfrom(netlink_socket, b, BUFF_SIZE, 0, (struct sockaddr *) &from_nla, &from_nla_len);
+    ssize_t bytesReceived = recvfrom(netlinkSocket, b, BUFF_SIZE, 0, (struct sockaddr *) &from_nla, &from_nla_len);
 
     if (from_nla.nl_pid != 0) {
         Log("nl_pid != 0");
@@ -155,6 +47,10 @@ void ReadFromNetlink(int netlink_socket) {
     }
 
     if (bytesReceived < 1) {
+        // The kernel had to drop events because we were not reading fast enough
+        if (bytesReceived == -1 && errno == ENOBUFS) {
+            kernelOverruns++;
+        }
         Log("bytesReceived < 1");
         return;
     }
@@ -166,7 +62,7 @@ void ReadFromNetlink(int netlink_socket) {
         if ((netlinkMsgHeader->nlmsg_type == NLMSG_ERROR) ||
             (netlinkMsgHeader->nlmsg_type == NLMSG_OVERRUN))
             break;
-        HandleMsg(cn_hdr);
+        router.Route(*(proc_event *) cn_hdr->data);
         if (netlinkMsgHeader->nlmsg_type == NLMSG_DONE)
             break;
         netlinkMsgHeader = NLMSG_NEXT(netlinkMsgHeader, bytesReceived);
@@ -236,15 +132,67 @@ static void BindToNetlink(int netlink_socket) {
     }
 }
 
-int InitNetlink() {
+void NetlinkSource::ReaderLoop() {
+    struct pollfd fds[2] = {
+            {.fd = netlinkSocket, .events = POLLIN, .revents = 0},
+            {.fd = stopFd, .events = POLLIN, .revents = 0},
+    };
+    while (!stop) {
+        int ready = poll(fds, 2, -1);
+        if (ready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Netlink poll error");
+            exit(EXIT_FAILURE);
+        }
+        if (fds[0].revents & POLLIN) {
+            ReadFromNetlink();
+        } else if (fds[0].revents & (POLLHUP | POLLERR)) {
+            perror("Netlink hangup?\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+NetlinkSource::NetlinkSource() {
     // Le netlink socket
-    int netlink_socket = socket(PF_NETLINK, SOCK_DGRAM, NETLINK_CONNECTOR);
-    if (netlink_socket == -1) {
+    netlinkSocket = socket(PF_NETLINK, SOCK_DGRAM, NETLINK_CONNECTOR);
+    if (netlinkSocket == -1) {
         perror("socket netlink_socket error");
         exit(EXIT_FAILURE);
     }
 
-    BindToNetlink(netlink_socket);
-    SendMCastListen(netlink_socket);
-    return netlink_socket;
+    BindToNetlink(netlinkSocket);
+    SendMCastListen(netlinkSocket);
+
+    stopFd = eventfd(0, EFD_CLOEXEC);
+    reader = std::thread(&NetlinkSource::ReaderLoop, this);
+}
+
+NetlinkSource::~NetlinkSource() {
+    stop = true;
+    uint64_t one = 1;
+    if (write(stopFd, &one, sizeof(one)) != sizeof(one)) {
+        perror("Cannot stop netlink reader");
+    }
+    reader.join();
+    close(stopFd);
+    close(netlinkSocket);
+}
+
+NetlinkSource::Subscription *NetlinkSource::Subscribe() {
+    return router.Subscribe();
+}
+
+void NetlinkSource::Unsubscribe(Subscription *subscription) {
+    router.Unsubscribe(subscription);
+}
+
+void NetlinkSource::AddRoot(Subscription *subscription, int pid) {
+    router.AddRoot(subscription, pid);
+}
+
+uint64_t NetlinkSource::Overruns() const {
+    return kernelOverruns;
 }
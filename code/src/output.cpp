@@ -1,74 +1,141 @@
 #include "output.h"
 #include "track.h"
 #include "utils.h"
+#include "proc.h"
+#include "perf.h"
 
 #include <locale.h>
 #include <cstdio>
+#include <string>
 #include <unordered_map>
 #include <algorithm>
+#include <vector>
 
-#include <sys/wait.h>
 
-static void GenerateASCII(FILE* out, uint64_t totalDurationMs) {
-    static uint64_t cwidth = 85;
-    static uint64_t cheight = 15;
-
-    // We need to generate the PSS values for [0,cwidth-1]
-    uint64_t psses[cwidth];
-    std::fill_n(psses, cwidth, 0);
-
-    // Transform events into combined pss for convenience
-    // We use timestamp as the key and pss as the value
-    std::unordered_map<long, long> psss;
-    for (const auto &event: events) {
-        switch (event.type) {
-            case PSS:
-                if (!psss.contains(event.timestamp)) {
-                    psss[event.timestamp] = 0;
-                }
-                psss[event.timestamp] = psss[event.timestamp] +  event.pss.value;
-                break;
-            default:
-                break;
-        }
-
-    }
+// How the values of a series falling in the same column are combined.
+enum ChartMode {
+    AVERAGE, // Gauges such as PSS. Empty columns repeat the previous one.
+    RATE,    // Amounts since the previous sample, summed into a per-second rate.
+    SHARE,   // Microseconds since the previous sample, as a percentage of the column.
+             // Can exceed 100 when summed over several CPUs.
+};
 
+enum ChartUnit {
+    BYTES,
+    COUNT,
+    PERCENT,
+};
 
+static std::vector<uint64_t> Bucket(const std::vector<std::pair<uint64_t, uint64_t>> &series,
+                                    uint64_t minTimestamp, uint64_t totalDurationMs,
+                                    uint64_t columns, ChartMode mode) {
     struct PssCal {
         uint64_t total = 0;
         uint64_t n = 0;
     };
+    std::vector<PssCal> pssCalcs(columns);
 
-    PssCal pssCalcs[cwidth];
-    std::fill_n(pssCalcs, cwidth, PssCal{0, 0});
-
-    uint64_t minTimestamp = events[0].timestamp;
-    float bracketWidth = (float)totalDurationMs / (float)cwidth;
-    uint64_t maxPss = GetMaxCombinedPss();
-
-    for (const auto pss: psss) {
-      uint64_t timestamp = pss.first - minTimestamp;
+    float bracketWidth = (float)totalDurationMs / (float)columns;
+    for (const auto &pss: series) {
+      uint64_t timestamp = pss.first - std::min(pss.first, minTimestamp);
       uint64_t bracket = (uint64_t)(timestamp / bracketWidth);
-      bracket = std::min(cwidth-1, bracket);
+      bracket = std::min(columns-1, bracket);
       pssCalcs[bracket].n++;
       pssCalcs[bracket].total += pss.second;
     }
 
-    // Now calc average
-    uint64_t lastAverage;
-    for (int i = 0; i < cwidth; i++) {
-        if (pssCalcs[i].total == 0) {
-            psses[i] = lastAverage;
-        } else {
-            psses[i] = pssCalcs[i].total / pssCalcs[i].n;
-            psses[i] = (psses[i] /(float)maxPss) * cheight;
+    std::vector<uint64_t> values(columns);
+    uint64_t lastAverage = 0;
+    for (uint64_t i = 0; i < columns; i++) {
+        switch (mode) {
+            case AVERAGE:
+                values[i] = pssCalcs[i].n == 0 ? lastAverage : pssCalcs[i].total / pssCalcs[i].n;
+                lastAverage = values[i];
+                break;
+            case RATE:
+                values[i] = pssCalcs[i].total * 1000 / std::max(bracketWidth, 1.0f);
+                break;
+            case SHARE:
+                values[i] = pssCalcs[i].total / (std::max(bracketWidth, 1.0f) * 10);
+                break;
         }
-        lastAverage = psses[i];
     }
+    return values;
+}
 
+// Draw the bottom line, with the unit of the values, and the time labels.
+static void DrawTimeAxis(FILE *out, uint64_t maxPss, ChartUnit unit, uint64_t totalDurationMs, uint64_t cwidth) {
+    // Draw bottom line
+    static const char *kByteLabels[] = {"0B ", "0KB", "0MB", "0GB", "0XB"};
+    static const char *kCountLabels[] = {"0  ", "0K ", "0M ", "0G ", "0X "};
+    int magnitude = 0;
+    for (uint64_t v = maxPss; v >= 1000 && magnitude < 4; v /= 1000) {
+        magnitude++;
+    }
+    switch (unit) {
+        case BYTES:
+            fprintf(out, "%s", kByteLabels[magnitude]);
+            break;
+        case COUNT:
+            fprintf(out, "%s", kCountLabels[magnitude]);
+            break;
+        case PERCENT:
+            fprintf(out, "0%% ");
+            break;
+    }
+    fprintf(out, "┗");
+    for (int i = 0 ; i < cwidth ; i++ ) {
+        const char* v =  i == cwidth/2 ? "┳" : "━";
+        fprintf(out, "%s", v);
+    }
+    fprintf(out, "┛\n");
 
+    // Draw bottom text
+    fprintf(out, "   ");
+    if (totalDurationMs < 1000) {
+        fprintf(out, "0ms");
+    } else if (totalDurationMs < 1000000){
+        fprintf(out, "0s ");
+    } else if (totalDurationMs < 1000000 * 60) {
+        fprintf(out, "0mn");
+    } else if (totalDurationMs < 1000000 * 60 * 24) {
+       fprintf(out, "0hr");
+     }
 
+    for (int i = 0 ; i < cwidth -4; i++ ) {
+        fprintf(out, " ");
+    }
+    while(totalDurationMs > 1000) {
+        totalDurationMs /= 1000;
+    }
+    fprintf(out, "%3lu\n", totalDurationMs);
+}
+
+// Draw a (timestamp, value) series as a bar chart.
+static void GenerateASCII(FILE* out, const std::vector<std::pair<uint64_t, uint64_t>> &series,
+                          uint64_t minTimestamp, uint64_t totalDurationMs,
+                          ChartMode mode = AVERAGE, ChartUnit unit = BYTES) {
+    static uint64_t cwidth = 85;
+    static uint64_t cheight = 15;
+
+    // We need to generate the values for [0,cwidth-1]
+    std::vector<uint64_t> psses = Bucket(series, minTimestamp, totalDurationMs, cwidth, mode);
+
+    // Gauges are scaled to their highest sample, not to the highest column average
+    uint64_t maxPss = 0;
+    for (const auto &pss: mode == AVERAGE ? series : std::vector<std::pair<uint64_t, uint64_t>>{}) {
+        maxPss = std::max(maxPss, pss.second);
+    }
+    for (uint64_t value: psses) {
+        maxPss = std::max(maxPss, value);
+    }
+    if (unit == PERCENT) {
+        maxPss = std::max<uint64_t>(maxPss, 100);
+    }
+
+    for (uint64_t i = 0; i < cwidth; i++) {
+        psses[i] = maxPss == 0 ? 0 : (psses[i] / (float)maxPss) * cheight;
+    }
 
    //Draw top line
     uint64_t displayMaxPss = maxPss;
@@ -110,64 +177,332 @@ static void GenerateASCII(FILE* out, uint64_t totalDurationMs) {
         fprintf(out, "┃\n");
     }
 
-    // Draw bottom line
-    if (maxPss < 1000) {
-      fprintf(out, "0B ");
-    } else if (maxPss < 1000000) {
-        fprintf(out, "0KB");
-    } else if (maxPss < 1000000000) {
-        fprintf(out, "0MB");
-    } else if (maxPss < 1000000000000) {
-        fprintf(out, "0GB");
-    } else {
-        fprintf(out, "0XB");
+    DrawTimeAxis(out, maxPss, unit, totalDurationMs, cwidth);
+}
+
+// Draw several series stacked on top of each other, one glyph per series.
+static void GenerateStackedASCII(FILE *out, const std::vector<std::vector<std::pair<uint64_t, uint64_t>>> &series,
+                                 const std::vector<const char *> &names,
+                                 uint64_t minTimestamp, uint64_t totalDurationMs) {
+    static const char *kGlyphs[] = {"█", "▓", "▒", "░", "#", "+", "-", "."};
+    static uint64_t cwidth = 85;
+    static uint64_t cheight = 15;
+
+    // Cumulated height of the series at each column.
+    std::vector<std::vector<uint64_t>> stacked;
+    for (const auto &values: series) {
+        stacked.push_back(Bucket(values, minTimestamp, totalDurationMs, cwidth, AVERAGE));
+        if (stacked.size() > 1) {
+            for (uint64_t i = 0; i < cwidth; i++) {
+                stacked.back()[i] += stacked[stacked.size() - 2][i];
+            }
+        }
     }
-    fprintf(out, "┗");
-    for (int i = 0 ; i < cwidth ; i++ ) {
-        const char* v =  i == cwidth/2 ? "┳" : "━";
-        fprintf(out, "%s", v);
+    uint64_t maxValue = 0;
+    for (uint64_t value: stacked.empty() ? std::vector<uint64_t>{} : stacked.back()) {
+        maxValue = std::max(maxValue, value);
     }
-    fprintf(out, "┛\n");
 
-    // Draw bottom text
     fprintf(out, "   ");
-    if (totalDurationMs < 1000) {
-        fprintf(out, "0ms");
-    } else if (totalDurationMs < 1000000){
-        fprintf(out, "0s ");
-    } else if (totalDurationMs < 1000000 * 60) {
-        fprintf(out, "0mn");
-    } else if (totalDurationMs < 1000000 * 60 * 24) {
-       fprintf(out, "0hr");
-     }
+    for (size_t s = 0; s < names.size() && s < std::size(kGlyphs); s++) {
+        fprintf(out, " %s %s", kGlyphs[s], names[s]);
+    }
+    fprintf(out, "\n");
 
-    for (int i = 0 ; i < cwidth -4; i++ ) {
-        fprintf(out, " ");
+    uint64_t displayMax = maxValue;
+    while (displayMax >= 1000) {
+        displayMax /= 1000;
     }
-    while(totalDurationMs > 1000) {
-        totalDurationMs /= 1000;
+    fprintf(out, "%3lu┏", displayMax);
+    for (uint64_t i = 0; i < cwidth; i++) {
+        fprintf(out, "━");
     }
-    fprintf(out, "%3lu\n", totalDurationMs);
+    fprintf(out, "┓\n");
+
+    // A cell belongs to the lowest series whose top reaches it.
+    for (int row = cheight - 1; row >= 0; row--) {
+        fprintf(out, row == (int) cheight / 2 ? "   ┫" : "   ┃");
+        for (uint64_t i = 0; i < cwidth; i++) {
+            const char *v = " ";
+            for (size_t s = 0; s < stacked.size() && s < std::size(kGlyphs); s++) {
+                if (maxValue != 0 && (stacked[s][i] / (float) maxValue) * cheight > row) {
+                    v = kGlyphs[s];
+                    break;
+                }
+            }
+            fprintf(out, "%s", v);
+        }
+        fprintf(out, "┃\n");
+    }
+
+    DrawTimeAxis(out, maxValue, BYTES, totalDurationMs, cwidth);
+}
+
+static void GenerateIoSummary(const Trace &trace, const std::unordered_map<int, IoCounters> &ioTotals) {
+    static constexpr size_t kMaxCommands = 10;
+
+    IoCounters total{};
+    std::unordered_map<std::string, IoCounters> byCommand;
+    for (const auto &[pid, counters]: ioTotals) {
+        IoCounters &command = byCommand[GetCommand(trace.cmdlines, pid)];
+        for (IoCounters *sum: {&total, &command}) {
+            sum->rchar += counters.rchar;
+            sum->wchar += counters.wchar;
+            sum->syscr += counters.syscr;
+            sum->syscw += counters.syscw;
+            sum->readBytes += counters.readBytes;
+            sum->writeBytes += counters.writeBytes;
+        }
+    }
+
+    printf("I/O: read %'zu bytes (%'zu from storage, %'zu syscalls) - written %'zu bytes (%'zu to storage, %'zu syscalls)\n",
+           total.rchar, total.readBytes, total.syscr, total.wchar, total.writeBytes, total.syscw);
+
+    std::vector<std::pair<std::string, IoCounters>> commands(byCommand.begin(), byCommand.end());
+    std::sort(commands.begin(), commands.end(), [](const auto &a, const auto &b) {
+        return a.second.rchar + a.second.wchar > b.second.rchar + b.second.wchar;
+    });
+    if (commands.size() > kMaxCommands) {
+        commands.resize(kMaxCommands);
+    }
+    for (const auto &[command, counters]: commands) {
+        printf("   %'16zu read %'16zu written  %s\n", counters.rchar, counters.wchar, command.c_str());
+    }
+}
+
+// Peak stall over windows of this length: per-tick percentages are too noisy to mean anything.
+static constexpr uint64_t kStallWindowMs = 100;
+
+static uint64_t PeakStallPercent(const std::vector<std::pair<uint64_t, uint64_t>> &stalls,
+                                 uint64_t minTimestamp, uint64_t durationMs) {
+    uint64_t windows = std::max<uint64_t>(1, durationMs / kStallWindowMs);
+    auto percents = Bucket(stalls, minTimestamp, durationMs, windows, SHARE);
+    return *std::max_element(percents.begin(), percents.end());
+}
+
+static uint64_t Total(const std::vector<std::pair<uint64_t, uint64_t>> &series) {
+    uint64_t total = 0;
+    for (const auto &[timestamp, value]: series) {
+        total += value;
+    }
+    return total;
+}
+
+static void GeneratePressureSummary(const std::vector<Event> &events, uint64_t minTimestamp, uint64_t durationMs) {
+    for (int resource = 0; resource < PSI_COUNT; resource++) {
+        auto some = GetStalls(events, (PsiResource) resource, false);
+        auto full = GetStalls(events, (PsiResource) resource, true);
+        if (some.empty()) {
+            continue;
+        }
+        printf("Stalled on %-6s some: %'zums (peak %zu%%) - full: %'zums (peak %zu%%)\n",
+               PsiName((PsiResource) resource),
+               Total(some) / 1000, PeakStallPercent(some, minTimestamp, durationMs),
+               Total(full) / 1000, PeakStallPercent(full, minTimestamp, durationMs));
+    }
+
+    auto [minorFaults, majorFaults] = GetFaultTotals(events);
+    printf("Page faults: %'zu minor - %'zu major\n", minorFaults, majorFaults);
+}
+
+static uint64_t Peak(const std::vector<std::pair<uint64_t, uint64_t>> &series) {
+    uint64_t peak = 0;
+    for (const auto &[timestamp, value]: series) {
+        peak = std::max(peak, value);
+    }
+    return peak;
+}
+
+// Peak of each mapping class, over the whole tree. Returns false if smaps
+// were not broken down.
+static bool GenerateMappingSummary(const Trace &trace) {
+    const std::vector<Event> &events = trace.events;
+    if (GetCombinedMapping(events, MAP_HEAP, &MappingUsage::pss).empty()) {
+        return false;
+    }
+    printf("%-10s %15s %15s %15s\n", "Mappings", "Peak PSS", "Private dirty", "Swap");
+    for (int mapping = 0; mapping < MAP_CLASS_COUNT; mapping++) {
+        printf("%-10s %'15zu %'15zu %'15zu\n", MappingClassName((MappingClass) mapping),
+               Peak(GetCombinedMapping(events, (MappingClass) mapping, &MappingUsage::pss)),
+               Peak(GetCombinedMapping(events, (MappingClass) mapping, &MappingUsage::privateDirty)),
+               Peak(GetCombinedMapping(events, (MappingClass) mapping, &MappingUsage::swap)));
+    }
+    const BreakdownStats &stats = trace.breakdown;
+    uint64_t snapshots = stats.reads + stats.deferred;
+    printf("Broken down: %'zu of %'zu process snapshots (%.1f%%, the others from smaps_rollup) - slowest read: %'zuus - up to every %'zu ticks\n",
+           stats.reads, snapshots, snapshots ? stats.reads * 100.0 / snapshots : 0.0, stats.maxReadUs,
+           stats.maxEveryTicks);
+    return true;
+}
+
+// Runnable counts flicker as processes wake up: the tail is measured over
+// windows of this length.
+static constexpr uint64_t kTailWindowMs = 100;
+// A window is part of the tail while fewer processes than this were runnable
+// on average over it.
+static constexpr uint64_t kTailParallelRunnable = 2;
+
+// Serial time at the end of the run: the trailing windows in which fewer than
+// kTailParallelRunnable processes were runnable on average, e.g. a final link
+// step.
+static uint64_t TailMs(const std::vector<Concurrency> &concurrency) {
+    auto parallel = [](uint64_t totalRunnable, uint64_t snapshots) {
+        return snapshots && totalRunnable >= snapshots * kTailParallelRunnable;
+    };
+
+    uint64_t endTimestamp = concurrency.back().timestamp;
+    uint64_t windowEnd = endTimestamp;
+    uint64_t total = 0;
+    uint64_t n = 0;
+    for (auto it = concurrency.rbegin(); it != concurrency.rend(); ++it) {
+        if (windowEnd - it->timestamp >= kTailWindowMs) {
+            if (parallel(total, n)) {
+                break;
+            }
+            windowEnd -= kTailWindowMs;
+            total = 0;
+            n = 0;
+        }
+        total += it->runnable;
+        n++;
+    }
+    if (parallel(total, n)) {
+        return endTimestamp - windowEnd;
+    }
+    return endTimestamp - concurrency.front().timestamp;
+}
+
+// Concurrency over the snapshots: how parallel the run was, and how long it
+// ran serially, with at most one runnable process.
+static void GenerateConcurrencySummary(const std::vector<Concurrency> &concurrency) {
+    std::vector<uint64_t> runnable;
+    uint64_t processes = 0;
+    uint64_t threads = 0;
+    uint64_t totalRunnable = 0;
+    uint64_t peakProcesses = 0;
+    uint64_t serialMs = 0;
+    for (size_t i = 0; i < concurrency.size(); i++) {
+        const Concurrency &c = concurrency[i];
+        runnable.push_back(c.runnable);
+        processes += c.processes;
+        threads += c.threads;
+        totalRunnable += c.runnable;
+        peakProcesses = std::max(peakProcesses, c.processes);
+        // Snapshots may have been missed: each one holds until the next.
+        if (i + 1 < concurrency.size() && c.runnable <= 1) {
+            serialMs += concurrency[i + 1].timestamp - c.timestamp;
+        }
+    }
+    std::sort(runnable.begin(), runnable.end());
+    size_t n = concurrency.size();
+    uint64_t durationMs = concurrency.back().timestamp - concurrency.front().timestamp;
+
+    printf("Concurrency: %.1f processes on average (peak %'zu) - %.1f threads - runnable: %.1f on average, p50 %zu, p95 %zu\n",
+           (double) processes / n, peakProcesses, (double) threads / n, (double) totalRunnable / n,
+           runnable[n / 2], runnable[std::min(n - 1, n * 95 / 100)]);
+    printf("Serial time (at most one runnable process): %'zums (%.0f%%) - tail: %'zums\n",
+           serialMs, durationMs ? serialMs * 100.0 / durationMs : 0.0, TailMs(concurrency));
+}
+
+// How late periodic snapshots were taken, relative to their deadline.
+static void GenerateClockSummary(const ClockStats &stats) {
+    if (stats.ticks == 0) {
+        return;
+    }
+    printf("Sampling: %'zu ticks every %'zuus - %'zu missed (%.1f%%) - max lateness: %'zuus\n",
+           stats.ticks, stats.periodUs, stats.missed, stats.missed * 100.0 / stats.ticks, stats.maxLateUs);
+    uint64_t serviced = stats.ticks - stats.missed;
+    uint64_t lower = 0;
+    for (int bucket = 0; bucket < kJitterBuckets; bucket++) {
+        uint64_t count = stats.jitter[bucket];
+        if (count) {
+            char range[32];
+            if (kJitterBucketUs[bucket] == UINT64_MAX) {
+                snprintf(range, sizeof(range), ">= %zuus", lower);
+            } else {
+                snprintf(range, sizeof(range), "%zu-%zuus", lower, kJitterBucketUs[bucket]);
+            }
+            int width = (int) (count * 40 / serviced);
+            printf("  %-12s %'9zu %5.1f%% %s\n", range, count, count * 100.0 / serviced,
+                   std::string(width, '#').c_str());
+        }
+        lower = kJitterBucketUs[bucket];
+    }
+}
+
+// Only timed for benchmarks, see SamplerOptions::timeHotPaths.
+static void GenerateHotPathSummary(const Trace &trace) {
+    const HotPathStats &stats = trace.hotPaths;
+    if (stats.track.calls == 0 && stats.snapshot.calls == 0) {
+        return;
+    }
+    uint64_t durationMs = std::max<uint64_t>(trace.endTimeMs - trace.startTimeMs, 1);
+    printf("Process events: %'zu in %'zums - %'zu events/s - %'zu ns/event\n",
+           trace.procEvents, durationMs, trace.procEvents * 1000 / durationMs,
+           trace.procEvents ? durationMs * 1000000 / trace.procEvents : 0);
+    printf("  %-12s %12s %12s %10s %10s\n", "Hot path", "calls", "processes", "ns/call", "ns/process");
+    for (const auto &[name, path]: {std::pair{"Track", stats.track},
+                                    std::pair{"Untrack", stats.untrack},
+                                    std::pair{"SnapshotPss", stats.snapshot}}) {
+        if (path.calls == 0) {
+            continue;
+        }
+        printf("  %-12s %'12zu %'12zu %'10zu %'10zu\n", name, path.calls, path.processes,
+               path.ns / path.calls, path.processes ? path.ns / path.processes : 0);
+    }
+}
+
+// Totals of the inherited counters once every process of the tree is gone.
+static void GeneratePerfSummary(const Trace &trace) {
+    if (!trace.perfAvailable) {
+        return;
+    }
+    const uint64_t *values = trace.perfTotals;
+    uint64_t taskClockMs = values[PERF_TASK_CLOCK] / 1000000;
+    printf("Task clock: %'zums - context switches: %'zu - cpu migrations: %'zu - page faults: %'zu\n",
+           taskClockMs, values[PERF_CONTEXT_SWITCHES], values[PERF_CPU_MIGRATIONS], values[PERF_PAGE_FAULTS]);
+    // The counters cover the whole tree, but rusage only the root and the
+    // children it reaped: orphans reparented away are missing from the split.
+    printf("Context switches of root + reaped children (rusage): voluntary: %'ld, involuntary: %'ld\n",
+           trace.usage.ru_nvcsw, trace.usage.ru_nivcsw);
 }
 
+static std::vector<CommandCost> GetTopCommands(const Trace &trace,
+                                               const std::unordered_map<int, uint64_t> &pssByteSeconds) {
+    static constexpr size_t kMaxCommands = 10;
+
+    std::unordered_map<std::string, uint64_t> byCommand;
+    for (const auto &[pid, byteSeconds]: pssByteSeconds) {
+        byCommand[GetCommand(trace.cmdlines, pid)] += byteSeconds;
+    }
+
+    std::vector<CommandCost> commands;
+    for (const auto &[command, byteSeconds]: byCommand) {
+        commands.push_back({command, byteSeconds});
+    }
+    std::sort(commands.begin(), commands.end(), [](const auto &a, const auto &b) {
+        return a.pssByteSeconds > b.pssByteSeconds;
+    });
+    if (commands.size() > kMaxCommands) {
+        commands.resize(kMaxCommands);
+    }
+    return commands;
+}
+
+RunSummary GenerateOutputs(const Trace &trace) {
+    const std::vector<Event> &events = trace.events;
+    const struct rusage &cmdStats = trace.usage;
 
-void GenerateOutputs(int pid, uint64_t startTimeMs) {
     // It's output time!
-    printf("Num threads = %lu\n", NumThreads());
-    printf("Num process = %lu\n", NumProcs());
+    printf("Num threads = %lu\n", trace.numThreads);
+    printf("Num process = %lu\n", trace.numProcesses);
     setlocale(LC_NUMERIC, "");
-    printf("Max PSS: %'zu bytes\n", GetMaxCombinedPss());
-
-    // Let's RIP the cmd process and gather some cmdStats
-    struct rusage cmdStats{};
-    int status;
-    int waited = wait4(pid, &status, 0, &cmdStats);
-    if (waited < 0) {
-        perror("Could not wait4");
-        exit(EXIT_FAILURE);
+    printf("Max PSS: %'zu bytes\n", GetMaxCombinedPss(events));
+    if (trace.triggeredSamples || trace.throttledSamples) {
+        printf("Event samples: %'zu (%'zu throttled)\n", trace.triggeredSamples, trace.throttledSamples);
     }
-    uint64_t endTimeMs = GetTimeMs();
-    uint64_t durationMs = endTimeMs - startTimeMs;
+
+    uint64_t durationMs = trace.endTimeMs - trace.startTimeMs;
 
 //    struct rusage childStats{};
 //    int usaged = getrusage(RUSAGE_CHILDREN, &childStats);
@@ -177,11 +512,112 @@ void GenerateOutputs(int pid, uint64_t startTimeMs) {
            toMs(cmdStats.ru_stime)// + toMs(childStats.ru_stime))
     );
 
+    auto pssByteSeconds = GetPssByteSeconds(events);
+    RunSummary summary{
+            .wallMs = durationMs,
+            .userMs = toMs(cmdStats.ru_utime),
+            .sysMs = toMs(cmdStats.ru_stime),
+            .maxPss = (uint64_t) GetMaxCombinedPss(events),
+            .pssByteSeconds = 0,
+            .numProcs = trace.numProcesses,
+            .topCommands = GetTopCommands(trace, pssByteSeconds),
+    };
+    for (const auto &[pid, byteSeconds]: pssByteSeconds) {
+        summary.pssByteSeconds += byteSeconds;
+    }
+    printf("PSS x time: %'zu byte-seconds\n", summary.pssByteSeconds);
+    GeneratePerfSummary(trace);
+    GenerateClockSummary(trace.clock);
+    GenerateHotPathSummary(trace);
+
+
+    for (const QueueStats &stats: trace.queues) {
+        printf("Queue %-22s %'zu pushed, max depth %'zu, %'zu backpressure, %'zu dropped\n",
+               stats.name, stats.pushed, stats.maxDepth, stats.backpressure, stats.dropped);
+    }
+    if (trace.netlinkOverruns) {
+        printf("Netlink: kernel dropped events %'zu times\n", trace.netlinkOverruns);
+    }
 
+    auto ioTotals = GetIoTotals(events);
+    if (!ioTotals.empty()) {
+        GenerateIoSummary(trace, ioTotals);
+    }
 
     if (!events.empty()) {
-        GenerateASCII(stdout, durationMs);
+        GeneratePressureSummary(events, events[0].timestamp, durationMs);
+    }
+    bool smapsBreakdown = GenerateMappingSummary(trace);
+    auto concurrency = GetConcurrency(events);
+    if (!concurrency.empty()) {
+        GenerateConcurrencySummary(concurrency);
+    }
+
+    if (!events.empty()) {
+        uint64_t minTimestamp = events[0].timestamp;
+        GenerateASCII(stdout, GetCombinedPss(events), minTimestamp, durationMs);
+        if (smapsBreakdown) {
+            std::vector<std::vector<std::pair<uint64_t, uint64_t>>> classes;
+            std::vector<const char *> names;
+            for (int mapping = 0; mapping < MAP_CLASS_COUNT; mapping++) {
+                classes.push_back(GetCombinedMapping(events, (MappingClass) mapping, &MappingUsage::pss));
+                names.push_back(MappingClassName((MappingClass) mapping));
+            }
+            printf("PSS by mapping class\n");
+            GenerateStackedASCII(stdout, classes, names, minTimestamp, durationMs);
+        }
+        if (!concurrency.empty()) {
+            std::vector<std::pair<uint64_t, uint64_t>> processes;
+            std::vector<std::pair<uint64_t, uint64_t>> threads;
+            std::vector<std::pair<uint64_t, uint64_t>> runnable;
+            for (const Concurrency &c: concurrency) {
+                processes.emplace_back(c.timestamp, c.processes);
+                threads.emplace_back(c.timestamp, c.threads);
+                runnable.emplace_back(c.timestamp, c.runnable);
+            }
+            printf("Live processes\n");
+            GenerateASCII(stdout, processes, minTimestamp, durationMs, AVERAGE, COUNT);
+            printf("Live threads\n");
+            GenerateASCII(stdout, threads, minTimestamp, durationMs, AVERAGE, COUNT);
+            printf("Runnable processes\n");
+            GenerateASCII(stdout, runnable, minTimestamp, durationMs, AVERAGE, COUNT);
+        }
+        if (!ioTotals.empty()) {
+            printf("I/O throughput (rchar+wchar per second)\n");
+            GenerateASCII(stdout, GetCombinedIo(events), minTimestamp, durationMs, RATE);
+        }
+
+        // Memory is always shown when available, cpu and io only if something stalled
+        for (int resource = 0; resource < PSI_COUNT; resource++) {
+            auto stalls = GetStalls(events, (PsiResource) resource, false);
+            if (stalls.empty() || (resource != PSI_MEMORY && Total(stalls) == 0)) {
+                continue;
+            }
+            printf("Stalled on %s (%% of time some task waited)\n", PsiName((PsiResource) resource));
+            GenerateASCII(stdout, stalls, minTimestamp, durationMs, SHARE, PERCENT);
+        }
+
+        auto taskClock = GetPerfDeltas(events, PERF_TASK_CLOCK);
+        if (!taskClock.empty()) {
+            for (auto &[timestamp, ns]: taskClock) {
+                ns /= 1000;
+            }
+            printf("CPU utilization (task-clock, %% of one CPU)\n");
+            GenerateASCII(stdout, taskClock, minTimestamp, durationMs, SHARE, PERCENT);
+        }
+
+        printf("Page faults per second (minor + major)\n");
+        GenerateASCII(stdout, GetCombinedFaults(events), minTimestamp, durationMs, RATE, COUNT);
     }
+    return summary;
+}
+
+void ReportSink::Write(const Trace &trace) {
+    summary = GenerateOutputs(trace);
+}
+
+const RunSummary &ReportSink::Summary() const {
+    return summary;
 }
 
 void InitOutput() {
@@ -0,0 +1,88 @@
+#include "perf.h"
+
+#include <cerrno>
+#include <cstring>
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+static const uint64_t kPerfConfigs[PERF_COUNT] = {
+        PERF_COUNT_SW_TASK_CLOCK,
+        PERF_COUNT_SW_CONTEXT_SWITCHES,
+        PERF_COUNT_SW_CPU_MIGRATIONS,
+        PERF_COUNT_SW_PAGE_FAULTS,
+};
+
+const char *PerfName(PerfCounter counter) {
+    static const char *kNames[PERF_COUNT] = {"task-clock", "context-switches", "cpu-migrations", "page-faults"};
+    return kNames[counter];
+}
+
+static int PerfEventOpen(struct perf_event_attr *attr, int pid) {
+    return (int) syscall(SYS_perf_event_open, attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+PerfCounters::~PerfCounters() {
+    Close();
+}
+
+bool PerfCounters::Open(int pid) {
+    for (int counter = 0; counter < PERF_COUNT; counter++) {
+        struct perf_event_attr attr{};
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_SOFTWARE;
+        attr.config = kPerfConfigs[counter];
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        attr.disabled = 1;
+        attr.enable_on_exec = 1;
+        attr.inherit = 1;
+
+        fds[counter] = PerfEventOpen(&attr, pid);
+        if (fds[counter] == -1) {
+            Log("Unable to open perf counter %s: %s\n", PerfName((PerfCounter) counter), strerror(errno));
+            Close();
+            return false;
+        }
+    }
+    open = true;
+    return true;
+}
+
+bool PerfCounters::IsOpen() const {
+    return open;
+}
+
+bool PerfCounters::Read(PerfCounter counter, uint64_t *value) const {
+    if (!open) {
+        return false;
+    }
+
+    struct {
+        uint64_t value;
+        uint64_t timeEnabled;
+        uint64_t timeRunning;
+    } data{};
+    if (read(fds[counter], &data, sizeof(data)) != sizeof(data)) {
+        return false;
+    }
+
+    // Software events are not multiplexed, but scale anyway in case they were.
+    if (data.timeRunning != 0 && data.timeRunning < data.timeEnabled) {
+        data.value = (uint64_t) ((double) data.value * data.timeEnabled / data.timeRunning);
+    }
+    *value = data.value;
+    return true;
+}
+
+void PerfCounters::Close() {
+    open = false;
+    for (int &fd: fds) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        fd = -1;
+    }
+}
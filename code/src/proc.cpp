@@ -2,6 +2,7 @@
 
 #include "utils.h"
 
+#include <cerrno>
 #include <string>
 #include <unordered_map>
 #include <cstring>
@@ -10,19 +11,21 @@
 #include <unistd.h>
 #include <fcntl.h>
 
-// Local cache for pid -> cmdline
-std::unordered_map<int, std::string> pidCmdlines;
-
-
-void Declare(int pid, const std::string& cmdline) {
-  pidCmdlines[pid] = cmdline;
+void Declare(CmdlineCache &cache, int pid, const std::string& cmdline) {
+  cache[pid] = cmdline;
 }
 
-std::string GetCmdline(int pid) {
-    if (pidCmdlines.contains(pid)) {
-        return pidCmdlines[pid];
+std::string GetCmdline(CmdlineCache &cache, ProcReader &proc, int pid) {
+    if (cache.contains(pid)) {
+        return cache[pid];
     }
 
+    std::string name = proc.ReadCmdline(pid);
+    cache[pid] = name;
+    return name;
+}
+
+std::string ReadCmdline(int pid) {
     // Get cmdLine
     ssize_t CMDLINE_BUFF_SIZE = 1024;
     char cmdline[CMDLINE_BUFF_SIZE];
@@ -34,7 +37,6 @@ std::string GetCmdline(int pid) {
     int fd = open(cmdlinePath, O_RDONLY);
     if (fd <= 0) {
         Log("Unable to open '%s'\n", cmdlinePath);
-        pidCmdlines[pid] = "";
         return "";
     }
 
@@ -47,29 +49,348 @@ std::string GetCmdline(int pid) {
             cmdline[i] = ' ';
     }
 
-    std::string name = std::string{cmdline};
-    pidCmdlines[pid] = name;
-    return name;
+    return std::string{cmdline};
 }
 
+std::string GetCommand(const CmdlineCache &cache, int pid) {
+    auto it = cache.find(pid);
+    std::string cmdline = it == cache.end() ? "" : it->second;
+    size_t start = cmdline.find_first_not_of(' ');
+    if (start == std::string::npos) {
+        return "?";
+    }
+    size_t end = cmdline.find(' ', start);
+    std::string argv0 = cmdline.substr(start, end == std::string::npos ? end : end - start);
+    size_t slash = argv0.rfind('/');
+    return slash == std::string::npos ? argv0 : argv0.substr(slash + 1);
+}
 
-// We sum all of /proc/%d/smaps
+// The total of /proc/%d/smaps_rollup
 uint64_t GetPSS(int pid) {
-    char procStatusPath[512];
-    snprintf(procStatusPath, sizeof(procStatusPath), "/proc/%d/smaps", pid);
-    FILE *f = fopen(procStatusPath, "r");
-    if (!f) {
+    return GetPSS(SystemProc(), pid);
+}
+
+uint64_t GetPSS(ProcReader &proc, int pid) {
+    int fd = proc.OpenSmapsRollup(pid);
+    if (fd < 0) {
         return 0;
     }
+    SmapsBreakdown breakdown{};
+    bool ok = ReadSmaps(fd, &breakdown);
+    close(fd);
+
+    uint64_t pss = 0;
+    for (const MappingUsage &usage: breakdown.classes) {
+        pss += usage.pss;
+    }
+    return ok ? pss : 0;
+}
+
+const char *MappingClassName(MappingClass mapping) {
+    static const char *kNames[MAP_CLASS_COUNT] = {"heap", "stack", "anon", "code", "file data", "shmem"};
+    return kNames[mapping];
+}
+
+int OpenSmaps(int pid) {
+    char smapsPath[512];
+    snprintf(smapsPath, sizeof(smapsPath), "/proc/%d/smaps", pid);
+    return open(smapsPath, O_RDONLY | O_CLOEXEC);
+}
+
+// Linux 4.14 and later.
+int OpenSmapsRollup(int pid) {
+    char rollupPath[512];
+    snprintf(rollupPath, sizeof(rollupPath), "/proc/%d/smaps_rollup", pid);
+    int fd = open(rollupPath, O_RDONLY | O_CLOEXEC);
+    if (fd == -1 && errno == ENOENT) {
+        return OpenSmaps(pid);
+    }
+    return fd;
+}
+
+static bool StartsWith(const char *line, const char *end, const char *prefix, size_t length) {
+    return (size_t) (end - line) >= length && memcmp(line, prefix, length) == 0;
+}
+
+static const char *SkipField(const char *p, const char *end) {
+    while (p < end && *p != ' ') p++;
+    while (p < end && *p == ' ') p++;
+    return p;
+}
+
+// "55d0c2a4e000-55d0c2a50000 r-xp 00002000 08:01 1234    /usr/bin/cat"
+static MappingClass ClassifyMapping(const char *line, const char *end) {
+    const char *perms = SkipField(line, end);
+    const char *path = SkipField(SkipField(SkipField(SkipField(perms, end), end), end), end);
+    bool shared = end - perms > 3 && perms[3] == 's';
+    bool executable = end - perms > 2 && perms[2] == 'x';
+
+    if (path == end) {
+        return shared ? MAP_SHMEM : MAP_ANON;
+    }
+    if (StartsWith(path, end, "[heap]", 6)) {
+        return MAP_HEAP;
+    }
+    if (StartsWith(path, end, "[stack", 6)) {
+        return MAP_STACK;
+    }
+    if (*path == '[') {
+        return MAP_ANON;
+    }
+    if (StartsWith(path, end, "/dev/shm/", 9) || StartsWith(path, end, "/SYSV", 5) ||
+        StartsWith(path, end, "/memfd:", 7)) {
+        return MAP_SHMEM;
+    }
+    return executable ? MAP_CODE : MAP_FILE_DATA;
+}
+
+// "Pss:                 12 kB"
+static uint64_t ParseKb(const char *p, const char *end) {
+    while (p < end && (*p < '0' || *p > '9')) p++;
+    uint64_t value = 0;
+    while (p < end && *p >= '0' && *p <= '9') {
+        value = value * 10 + (*p++ - '0');
+    }
+    return value * 1024;
+}
+
+static void ParseSmapsLine(const char *line, const char *end, MappingClass *current, SmapsBreakdown *breakdown) {
+    // Mapping headers start with a lowercase hex address, fields with a capital.
+    if (line == end) {
+        return;
+    }
+    if (*line < 'A' || *line > 'Z') {
+        *current = ClassifyMapping(line, end);
+        return;
+    }
+    MappingUsage &usage = breakdown->classes[*current];
+    if (StartsWith(line, end, "Pss:", 4)) {
+        usage.pss += ParseKb(line + 4, end);
+    } else if (StartsWith(line, end, "Private_Dirty:", 14)) {
+        usage.privateDirty += ParseKb(line + 14, end);
+    } else if (StartsWith(line, end, "Swap:", 5)) {
+        usage.swap += ParseKb(line + 5, end);
+    }
+}
+
+// smaps of a large process is megabytes long: read it in chunks and parse the
+// lines where they are, only moving a partial line to the front of the buffer.
+bool ReadSmaps(int fd, SmapsBreakdown *breakdown) {
+    static thread_local char buff[64 * 1024];
+    size_t used = 0;
+    off_t offset = 0;
+    MappingClass current = MAP_ANON;
+
+    for (;;) {
+        ssize_t r = pread(fd, buff + used, sizeof(buff) - used, offset);
+        if (r < 0) {
+            return false;
+        }
+        if (r == 0) {
+            break;
+        }
+        offset += r;
+        used += r;
+
+        const char *line = buff;
+        const char *end = buff + used;
+        while (const char *eol = (const char *) memchr(line, '\n', end - line)) {
+            ParseSmapsLine(line, eol, &current, breakdown);
+            line = eol + 1;
+        }
+        used = end - line;
+        if (used == sizeof(buff)) {
+            // A single line filling the buffer cannot be a field we want.
+            used = 0;
+        }
+        memmove(buff, line, used);
+    }
+    return offset > 0;
+}
+
+int OpenIo(int pid) {
+    char ioPath[512];
+    snprintf(ioPath, sizeof(ioPath), "/proc/%d/io", pid);
+    return open(ioPath, O_RDONLY | O_CLOEXEC);
+}
+
+// Lines are "name: value\n", always in the same order.
+bool ReadIo(int fd, IoCounters *counters) {
+    char buff[512];
+    ssize_t r = pread(fd, buff, sizeof(buff) - 1, 0);
+    if (r <= 0) {
+        return false;
+    }
+    buff[r] = 0;
+
+    uint64_t *fields[] = {&counters->rchar, &counters->wchar, &counters->syscr, &counters->syscw,
+                          &counters->readBytes, &counters->writeBytes};
+    char *p = buff;
+    for (uint64_t *field: fields) {
+        p = strchr(p, ':');
+        if (!p) {
+            return false;
+        }
+        *field = strtoull(p + 1, &p, 10);
+    }
+    return true;
+}
+
+int OpenStat(int pid) {
+    char statPath[512];
+    snprintf(statPath, sizeof(statPath), "/proc/%d/stat", pid);
+    return open(statPath, O_RDONLY | O_CLOEXEC);
+}
+
+// "pid (comm) state ppid ...": comm may contain spaces and parentheses, so
+// fields are counted from the last ')'.
+bool ReadStat(int fd, ProcStat *stat) {
+    static const long kTicksPerSecond = sysconf(_SC_CLK_TCK);
+    static constexpr int kMinfltField = 10;
+    static constexpr int kMajfltField = 12;
+    static constexpr int kUtimeField = 14;
+    static constexpr int kStimeField = 15;
+    static constexpr int kCutimeField = 16;
+    static constexpr int kCstimeField = 17;
+    static constexpr int kNumThreadsField = 20;
+
+    char buff[1024];
+    ssize_t r = pread(fd, buff, sizeof(buff) - 1, 0);
+    if (r <= 0) {
+        return false;
+    }
+    buff[r] = 0;
+
+    char *p = strrchr(buff, ')');
+    if (!p) {
+        return false;
+    }
+    p += 2; // Skip ") "
+    stat->state = *p;
+    for (int field = 3; field <= kNumThreadsField && *p; field++) {
+        char *end;
+        uint64_t value = strtoull(p, &end, 10);
+        if (field == kMinfltField) {
+            stat->minorFaults = value;
+        } else if (field == kMajfltField) {
+            stat->majorFaults = value;
+        } else if (field == kUtimeField) {
+            stat->userMs = value * 1000 / kTicksPerSecond;
+        } else if (field == kStimeField) {
+            stat->sysMs = value * 1000 / kTicksPerSecond;
+        } else if (field == kCutimeField) {
+            stat->childrenMs = value * 1000 / kTicksPerSecond;
+        } else if (field == kCstimeField) {
+            stat->childrenMs += value * 1000 / kTicksPerSecond;
+        } else if (field == kNumThreadsField) {
+            stat->numThreads = value;
+        }
+        p = strchr(p, ' ');
+        if (!p) {
+            break;
+        }
+        p++;
+    }
+    return true;
+}
+
+const char *PsiName(PsiResource resource) {
+    static const char *kNames[] = {"memory", "cpu", "io"};
+    return kNames[resource];
+}
+
+// The unified hierarchy is the "0::/path" line of /proc/self/cgroup.
+static std::string GetCgroupPath() {
+    FILE *f = fopen("/proc/self/cgroup", "r");
+    if (!f) {
+        return "";
+    }
     char line[1024];
-    long pss = 0;
+    std::string path;
     while (fgets(line, sizeof(line), f) != nullptr) {
-        if (strncmp("Pss:", line, 4) == 0) {
-            char *pch = strtok(line, " ");
-            pch = strtok(nullptr, " ");
-            pss += atoi(pch);
+        if (strncmp(line, "0::", 3) == 0) {
+            line[strcspn(line, "\n")] = 0;
+            path = line + 3;
+            break;
         }
     }
     fclose(f);
-    return pss * 1024;
+    return path;
+}
+
+int OpenPressure(PsiResource resource, bool cgroup) {
+    char pressurePath[1024];
+    if (!cgroup) {
+        snprintf(pressurePath, sizeof(pressurePath), "/proc/pressure/%s", PsiName(resource));
+        return open(pressurePath, O_RDONLY | O_CLOEXEC);
+    }
+
+    std::string cgroupPath = GetCgroupPath();
+    for (const char *root: {"/sys/fs/cgroup", "/sys/fs/cgroup/unified"}) {
+        snprintf(pressurePath, sizeof(pressurePath), "%s%s/%s.pressure", root, cgroupPath.c_str(), PsiName(resource));
+        int fd = open(pressurePath, O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            return fd;
+        }
+    }
+    Log("Unable to open cgroup %s pressure\n", PsiName(resource));
+    return -1;
+}
+
+// "some avg10=0.00 avg60=0.00 avg300=0.00 total=0\nfull ... total=0\n".
+// cpu has no "full" line on older kernels.
+bool ReadPressure(int fd, Pressure *pressure) {
+    char buff[256];
+    ssize_t r = pread(fd, buff, sizeof(buff) - 1, 0);
+    if (r <= 0) {
+        return false;
+    }
+    buff[r] = 0;
+
+    *pressure = {0, 0};
+    for (char *line = buff; line && *line; line = strchr(line, '\n') ? strchr(line, '\n') + 1 : nullptr) {
+        char *total = strstr(line, "total=");
+        if (!total) {
+            continue;
+        }
+        uint64_t value = strtoull(total + 6, nullptr, 10);
+        if (strncmp(line, "some", 4) == 0) {
+            pressure->someUs = value;
+        } else if (strncmp(line, "full", 4) == 0) {
+            pressure->fullUs = value;
+        }
+    }
+    return true;
+}
+
+class SystemProcReader : public ProcReader {
+public:
+    std::string ReadCmdline(int pid) override {
+        return ::ReadCmdline(pid);
+    }
+
+    int OpenIo(int pid) override {
+        return ::OpenIo(pid);
+    }
+
+    int OpenStat(int pid) override {
+        return ::OpenStat(pid);
+    }
+
+    int OpenSmaps(int pid) override {
+        return ::OpenSmaps(pid);
+    }
+
+    int OpenSmapsRollup(int pid) override {
+        return ::OpenSmapsRollup(pid);
+    }
+
+    int OpenPressure(PsiResource resource, bool cgroup) override {
+        return ::OpenPressure(resource, cgroup);
+    }
+};
+
+ProcReader &SystemProc() {
+    static SystemProcReader proc;
+    return proc;
 }
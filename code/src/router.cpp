@@ -0,0 +1,110 @@
+#include "router.h"
+
+#include "utils.h"
+
+static void OnUid(const proc_event *ev) {
+    Log("UID:pid=%d,%d ruid=%d,euid=%d\n",
+        ev->event_data.id.process_pid, ev->event_data.id.process_tgid,
+        ev->event_data.id.r.ruid, ev->event_data.id.e.euid);
+}
+
+static void OnGid(const proc_event *ev) {
+    Log("gid change: pid=%d tgid=%d from %d to %d\n",
+        ev->event_data.id.process_pid,
+        ev->event_data.id.process_tgid,
+        ev->event_data.id.r.rgid,
+        ev->event_data.id.e.egid);
+}
+
+/*     PARENT       CHILD
+ *   TGID   PID   TGID   PID
+ *
+ *    X             B     B       X forked into B
+ *    A             A     X       A created thread X
+ *
+ *    A new process belongs to the tree of its parent, a new thread to the
+ *    tree of its process. The root itself was added with AddRoot().
+ */
+void EventRouter::Route(const proc_event &event) {
+    std::unique_lock<std::mutex> lock(mutex);
+    std::shared_ptr<Subscription> owner;
+    auto find = [&](int tgid) {
+        auto it = owners.find(tgid);
+        return it == owners.end() ? nullptr : it->second;
+    };
+
+    switch (event.what) {
+        case proc_event::PROC_EVENT_NONE:
+            Log("Listen request received\n");
+            break;
+        case proc_event::PROC_EVENT_FORK: {
+            const auto &fork = event.event_data.fork;
+            if (fork.child_pid != fork.child_tgid) {
+                owner = find(fork.child_tgid);
+            } else if ((owner = find(fork.parent_tgid))) {
+                owners[fork.child_tgid] = owner;
+            } else {
+                owner = find(fork.child_tgid);
+            }
+            break;
+        }
+        case proc_event::PROC_EVENT_EXEC:
+            owner = find(event.event_data.exec.process_tgid);
+            break;
+        case proc_event::PROC_EVENT_EXIT: {
+            const auto &exited = event.event_data.exit;
+            owner = find(exited.process_tgid);
+            if (owner && exited.process_pid == exited.process_tgid) {
+                owners.erase(exited.process_tgid);
+            }
+            break;
+        }
+        case proc_event::PROC_EVENT_UID:
+            OnUid(&event);
+            break;
+        case proc_event::PROC_EVENT_GID:
+            OnGid(&event);
+            break;
+        case proc_event::PROC_EVENT_SID:
+        case proc_event::PROC_EVENT_PTRACE:
+        case proc_event::PROC_EVENT_COMM:
+        case proc_event::PROC_EVENT_COREDUMP:
+            break;
+        default:
+            Log("Unhandled message %d\n", event.what);
+            break;
+    }
+
+    // A slow (or gone) aggregator must not hold the routes of the others.
+    lock.unlock();
+    if (owner) {
+        ProcessEventSource::Deliver(owner.get(), event);
+    }
+}
+
+EventRouter::Subscription *EventRouter::Subscribe() {
+    std::lock_guard<std::mutex> lock(mutex);
+    subscriptions.push_back(std::make_shared<Subscription>(queueName));
+    return subscriptions.back().get();
+}
+
+void EventRouter::Unsubscribe(Subscription *subscription) {
+    std::lock_guard<std::mutex> lock(mutex);
+    ProcessEventSource::Close(subscription);
+    std::erase_if(owners, [&](const auto &owner) { return owner.second.get() == subscription; });
+    std::erase_if(subscriptions, [&](const auto &s) { return s.get() == subscription; });
+}
+
+void EventRouter::AddRoot(Subscription *subscription, int pid) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (const auto &s: subscriptions) {
+        if (s.get() == subscription) {
+            owners[pid] = s;
+        }
+    }
+}
+
+bool EventRouter::Empty() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return subscriptions.empty();
+}
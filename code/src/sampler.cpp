@@ -0,0 +1,444 @@
+#include "sampler.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <initializer_list>
+
+#include <poll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+static constexpr int kSnapshotEveryMs = 1;
+
+const uint64_t kJitterBucketUs[kJitterBuckets] = {10, 50, 100, 250, 500, 1000, 5000, UINT64_MAX};
+
+// Sampling budget, in /proc/PID/smaps reads.
+static constexpr double kSampleReadsPerUs = 0.05; // 50,000 reads per second
+static constexpr double kSampleBudgetMax = 256;
+
+static constexpr uint64_t kBurstEveryUs = 250;
+
+// Share of the sampler's time the smaps breakdowns may take, all processes
+// together.
+static constexpr uint64_t kBreakdownLoadPercent = 25;
+
+static void CloseFds(std::initializer_list<int> fds) {
+    for (int fd: fds) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+}
+
+Sampler::Sampler(const SamplerOptions &options, const PerfCounters *perf, ProcReader &proc)
+        : options(options), perf(perf), proc(proc), sampleTokens(kSampleBudgetMax) {
+}
+
+Sampler::~Sampler() {
+    if (thread.joinable()) {
+        Stop();
+    }
+}
+
+// An open smaps file is bound to the address space the process had when it
+// was opened, and reads empty once it exec'd: reopen it then.
+// The same goes for smaps_rollup.
+bool Sampler::ReadSmapsFd(int pid, bool rollup, int *fd, SmapsBreakdown *breakdown) {
+    if (*fd >= 0 && ReadSmaps(*fd, breakdown)) {
+        return true;
+    }
+    if (*fd >= 0) {
+        close(*fd);
+    }
+    *fd = rollup ? proc.OpenSmapsRollup(pid) : proc.OpenSmaps(pid);
+    return *fd >= 0 && ReadSmaps(*fd, breakdown);
+}
+
+// Spread the breakdowns so they take about kBreakdownLoadPercent of the
+// sampling period: a process whose smaps took readUs to read is broken down
+// again once every process had the time for one such read.
+void Sampler::ScheduleBreakdown(ProcFds *fds, uint64_t tick, uint64_t readUs) {
+    uint64_t everyTicks = 1 + readUs * procFds.size() * 100 / (clockStats.periodUs * kBreakdownLoadPercent);
+    fds->nextBreakdownTick = tick + everyTicks;
+    breakdownStats.reads++;
+    breakdownStats.maxReadUs = std::max(breakdownStats.maxReadUs, readUs);
+    breakdownStats.maxEveryTicks = std::max(breakdownStats.maxEveryTicks, everyTicks);
+}
+
+void Sampler::Time(HotPath *path, uint64_t startNs, uint64_t processes) {
+    path->calls++;
+    path->processes += processes;
+    path->ns += GetTimeNs() - startNs;
+}
+
+void Sampler::RefillBudget() {
+    uint64_t now = GetTimeUs();
+    sampleTokens = std::min(kSampleBudgetMax, sampleTokens + (now - lastRefillUs) * kSampleReadsPerUs);
+    lastRefillUs = now;
+}
+
+// Periodic samples are stamped with the deadline of their tick rather than the
+// time they were read, so a late tick does not skew the time series.
+void Sampler::SnapshotPss(uint64_t deadlineUs) {
+    uint64_t startNs = options.timeHotPaths ? GetTimeNs() : 0;
+    RefillBudget();
+    uint64_t tick = ++snapshots;
+    sampleTokens = std::max(0.0, sampleTokens - procFds.size());
+
+    uint64_t now = deadlineUs / 1000;
+    for (int resource = 0; resource < PSI_COUNT; resource++) {
+        Psi psi{(PsiResource) resource, {}};
+        if (pressureFds[resource] >= 0 && ReadPressure(pressureFds[resource], &psi.pressure)) {
+            samples.TryPush({.timestamp = now,
+                                    .type = PRESSURE,
+                                    .triggered = false,
+                                    .tick = tick,
+                                    .psi = psi}
+            );
+        }
+    }
+
+    for (int counter = 0; perf && counter < PERF_COUNT; counter++) {
+        PerfValue value{(PerfCounter) counter, 0};
+        if (perf->Read(value.counter, &value.value)) {
+            samples.TryPush({.timestamp = now,
+                                    .type = PERF,
+                                    .triggered = false,
+                                    .tick = tick,
+                                    .perf = value}
+            );
+        }
+    }
+
+    for (auto &[pid, fds]: procFds) {
+        // One read either way: the total comes with the breakdown when one is due.
+        SmapsBreakdown breakdown{};
+        uint64_t pss = 0;
+        if (options.smapsBreakdown && tick >= fds.nextBreakdownTick) {
+            uint64_t readStartUs = GetTimeUs();
+            bool read = ReadSmapsFd(pid, false, &fds.smaps, &breakdown);
+            ScheduleBreakdown(&fds, tick, GetTimeUs() - readStartUs);
+            for (int mapping = 0; read && mapping < MAP_CLASS_COUNT; mapping++) {
+                samples.TryPush({.timestamp = now,
+                                        .type = MAPPING,
+                                        .triggered = false,
+                                        .tick = tick,
+                                        .mapping = {pid, (MappingClass) mapping, breakdown.classes[mapping]}}
+                );
+            }
+        } else {
+            breakdownStats.deferred += options.smapsBreakdown;
+            ReadSmapsFd(pid, true, &fds.smapsRollup, &breakdown);
+        }
+        for (const MappingUsage &usage: breakdown.classes) {
+            pss += usage.pss;
+        }
+        samples.TryPush({.timestamp = now,
+                                .type = PSS,
+                                .triggered = false,
+                                .tick = tick,
+                                .pss = {pid, pss}}
+        );
+
+        Io io{pid, {}};
+        if (fds.io >= 0 && ReadIo(fds.io, &io.counters)) {
+            samples.TryPush({.timestamp = now,
+                                    .type = IO,
+                                    .triggered = false,
+                                    .tick = tick,
+                                    .io = io}
+            );
+        }
+
+        Stat stat{pid, {}};
+        if (fds.stat >= 0 && ReadStat(fds.stat, &stat.stat)) {
+            samples.TryPush({.timestamp = now,
+                                    .type = STAT,
+                                    .triggered = false,
+                                    .tick = tick,
+                                    .stat = stat}
+            );
+        }
+    }
+    if (options.timeHotPaths) {
+        Time(&hotPaths.snapshot, startNs, procFds.size());
+    }
+}
+
+void Sampler::AddPendingSample(int pid, bool burst, uint64_t now) {
+    uint64_t burstEnd = burst && options.burstMs ? now + options.burstMs * 1000 : 0;
+    for (auto &pending: pendingSamples) {
+        if (pending.pid == pid) {
+            pending.dueUs = now;
+            pending.burstEndUs = std::max(pending.burstEndUs, burstEnd);
+            return;
+        }
+    }
+    pendingSamples.push_back({pid, now, burstEnd});
+}
+
+uint64_t Sampler::NextTriggeredSampleUs() const {
+    uint64_t next = 0;
+    for (const auto &pending: pendingSamples) {
+        if (next == 0 || pending.dueUs < next) {
+            next = pending.dueUs;
+        }
+    }
+    return next;
+}
+
+void Sampler::SnapshotTriggered() {
+    RefillBudget();
+    uint64_t nowUs = GetTimeUs();
+    uint64_t now = GetTimeMs();
+    std::erase_if(pendingSamples, [&](PendingSample &pending) {
+        if (pending.dueUs > nowUs) {
+            return false;
+        }
+        if (sampleTokens >= 1) {
+            sampleTokens -= 1;
+            numTriggeredSamples++;
+            samples.TryPush({.timestamp = now,
+                                    .type = PSS,
+                                    .triggered = true,
+                                    .pss = {pending.pid, GetPSS(proc, pending.pid)}}
+            );
+        } else {
+            numThrottledSamples++;
+        }
+        pending.dueUs = nowUs + kBurstEveryUs;
+        return pending.dueUs > pending.burstEndUs;
+    });
+}
+
+void Sampler::HandleCommand(const Command &command) {
+    uint64_t startNs = options.timeHotPaths ? GetTimeNs() : 0;
+    switch (command.type) {
+        case TRACK:
+            procFds[command.pid] = {proc.OpenIo(command.pid), proc.OpenStat(command.pid),
+                                    options.smapsBreakdown ? proc.OpenSmaps(command.pid) : -1,
+                                    proc.OpenSmapsRollup(command.pid), 0};
+            samples.Push({.timestamp = command.timeUs / 1000,
+                                 .type = FORK,
+                                 .triggered = false,
+                                 .process = {command.pid, command.parent}}
+            );
+            if (options.timeHotPaths) {
+                Time(&hotPaths.track, startNs, 1);
+            }
+            break;
+        case UNTRACK:
+            if (auto it = procFds.find(command.pid); it != procFds.end()) {
+                // The CPU time used since the last tick, all of it for a process
+                // which lived less than a tick, is only known now. Lost if the
+                // parent already reaped it.
+                Stat stat{command.pid, {}};
+                if (it->second.stat >= 0 && ReadStat(it->second.stat, &stat.stat)) {
+                    samples.Push({.timestamp = command.timeUs / 1000,
+                                         .type = STAT,
+                                         .triggered = true,
+                                         .stat = stat}
+                    );
+                }
+                CloseFds({it->second.io, it->second.stat, it->second.smaps, it->second.smapsRollup});
+                procFds.erase(it);
+            }
+            std::erase_if(pendingSamples, [&](const PendingSample &p) { return p.pid == command.pid; });
+            samples.Push({.timestamp = command.timeUs / 1000,
+                                 .type = EXIT,
+                                 .triggered = false,
+                                 .process = {command.pid, 0}}
+            );
+            if (options.timeHotPaths) {
+                Time(&hotPaths.untrack, startNs, 1);
+            }
+            break;
+        case SAMPLE:
+            AddPendingSample(command.pid, command.burst, command.timeUs);
+            break;
+        case STOP:
+            running = false;
+            break;
+    }
+}
+
+void Sampler::StartClock() {
+    timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timerFd == -1) {
+        perror("Cannot create sampling timer");
+        exit(EXIT_FAILURE);
+    }
+
+    // Same clock as GetTimeUs(), so deadlines and timestamps line up.
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    firstTickUs = now.tv_sec * 1000000 + now.tv_nsec / 1000;
+    struct itimerspec spec = {
+            .it_interval = {.tv_sec = kSnapshotEveryMs / 1000, .tv_nsec = kSnapshotEveryMs % 1000 * 1000000},
+            .it_value = now,
+    };
+    if (timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &spec, nullptr) == -1) {
+        perror("Cannot arm sampling timer");
+        exit(EXIT_FAILURE);
+    }
+    clockStats = {.periodUs = kSnapshotEveryMs * 1000};
+}
+
+// Returns true if a tick is due, with its deadline. Ticks which expired while
+// we were busy are counted as missed: a single snapshot is taken for all of
+// them, at the deadline of the latest.
+bool Sampler::ConsumeTick(uint64_t *deadlineUs) {
+    uint64_t expirations;
+    if (read(timerFd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        return false;
+    }
+    clockStats.ticks += expirations;
+    clockStats.missed += expirations - 1;
+
+    // Lateness relative to the deadline of the latest expiration.
+    *deadlineUs = firstTickUs + (clockStats.ticks - 1) * clockStats.periodUs;
+    uint64_t nowUs = GetTimeUs();
+    uint64_t lateUs = nowUs - std::min(nowUs, *deadlineUs);
+    clockStats.maxLateUs = std::max(clockStats.maxLateUs, lateUs);
+    int bucket = 0;
+    while (lateUs >= kJitterBucketUs[bucket]) {
+        bucket++;
+    }
+    clockStats.jitter[bucket]++;
+    return true;
+}
+
+void Sampler::Loop() {
+    struct pollfd fds[2] = {{.fd = commands.NotifyFd(), .events = POLLIN, .revents = 0},
+                            {.fd = timerFd, .events = POLLIN, .revents = 0}};
+
+    while (running) {
+        // The timer wakes us up for periodic snapshots. Only wake up earlier
+        // if an event-triggered sample is due.
+        struct timespec timeOut{};
+        struct timespec *timeOutPtr = nullptr;
+        uint64_t nextTriggeredUs = NextTriggeredSampleUs();
+        if (nextTriggeredUs != 0) {
+            int64_t timeOutUs = std::max<int64_t>(0, (int64_t) nextTriggeredUs - (int64_t) GetTimeUs());
+            timeOut = {.tv_sec = timeOutUs / 1000000, .tv_nsec = (timeOutUs % 1000000) * 1000};
+            timeOutPtr = &timeOut;
+        }
+
+        int ready = ppoll(fds, 2, timeOutPtr, nullptr);
+        if (ready == -1 && errno != EINTR) {
+            perror("Sampler poll error");
+            exit(EXIT_FAILURE);
+        }
+
+        commands.ClearNotify();
+        Command command;
+        while (commands.Pop(&command)) {
+            HandleCommand(command);
+        }
+
+        uint64_t deadlineUs;
+        if (ConsumeTick(&deadlineUs)) {
+            SnapshotPss(deadlineUs);
+        }
+
+        // Fork/exec may have queued out-of-band samples.
+        SnapshotTriggered();
+    }
+
+    for (const auto &[pid, fds]: procFds) {
+        CloseFds({fds.io, fds.stat, fds.smaps, fds.smapsRollup});
+    }
+    procFds.clear();
+    for (int &fd: pressureFds) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        fd = -1;
+    }
+    close(timerFd);
+    timerFd = -1;
+}
+
+void Sampler::Start() {
+    for (int resource = 0; resource < PSI_COUNT; resource++) {
+        pressureFds[resource] = proc.OpenPressure((PsiResource) resource, options.pressureFromCgroup);
+    }
+    lastRefillUs = GetTimeUs();
+    StartClock();
+    thread = std::thread(&Sampler::Loop, this);
+}
+
+void Sampler::PushCommand(const Command &command) {
+    commands.Push(command, [this] {
+        HandleSamples();
+        sched_yield();
+    });
+}
+
+void Sampler::Stop() {
+    PushCommand({.type = STOP});
+    thread.join();
+}
+
+void Sampler::Track(int pid, int parent) {
+    PushCommand({.type = TRACK, .pid = pid, .parent = parent, .timeUs = GetTimeUs()});
+}
+
+void Sampler::Untrack(int pid) {
+    PushCommand({.type = UNTRACK, .pid = pid, .timeUs = GetTimeUs()});
+}
+
+void Sampler::RequestSample(int pid, bool burst) {
+    if (!options.triggeredSamples) {
+        return;
+    }
+    PushCommand({.type = SAMPLE, .pid = pid, .burst = burst, .timeUs = GetTimeUs()});
+}
+
+int Sampler::SamplesFd() const {
+    return samples.NotifyFd();
+}
+
+void Sampler::SetSampleHandler(std::function<void(const Event &)> handler) {
+    sampleHandler = std::move(handler);
+}
+
+void Sampler::HandleSamples() {
+    samples.ClearNotify();
+    Event event;
+    while (samples.Pop(&event)) {
+        sampleHandler(event);
+    }
+}
+
+uint64_t Sampler::NumTriggeredSamples() const {
+    return numTriggeredSamples;
+}
+
+uint64_t Sampler::NumThrottledSamples() const {
+    return numThrottledSamples;
+}
+
+ClockStats Sampler::GetClockStats() const {
+    return clockStats;
+}
+
+HotPathStats Sampler::GetHotPathStats() const {
+    return hotPaths;
+}
+
+BreakdownStats Sampler::GetBreakdownStats() const {
+    return breakdownStats;
+}
+
+QueueStats Sampler::CommandStats() const {
+    return commands.Stats();
+}
+
+QueueStats Sampler::OutputStats() const {
+    return samples.Stats();
+}
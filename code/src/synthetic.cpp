@@ -0,0 +1,603 @@
+#include "synthetic.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <cstring>
+#include <random>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+static constexpr int kRootPid = 1;
+
+// How often the replay rewrites the counters of all live processes, on top of
+// their own events: the sampling period.
+static constexpr uint64_t kCountersRefreshUs = 1000;
+
+static int WriteMemfd(const char *name, const std::string &contents) {
+    int fd = memfd_create(name, MFD_CLOEXEC);
+    if (fd == -1) {
+        perror("Cannot create memfd");
+        exit(EXIT_FAILURE);
+    }
+    size_t written = 0;
+    while (written < contents.size()) {
+        ssize_t w = write(fd, contents.data() + written, contents.size() - written);
+        if (w <= 0) {
+            perror("Cannot write memfd");
+            exit(EXIT_FAILURE);
+        }
+        written += w;
+    }
+    return fd;
+}
+
+// Same layout as the kernel's, so ReadSmaps() does the work it does on a real
+// process of that size.
+static std::string GenerateSmaps(const std::string &name, int mappings, int pssKb) {
+    std::string smaps;
+    char entry[1024];
+    uint64_t address = 0x555555554000;
+    for (int i = 0; i < mappings; i++) {
+        const char *perms = "rw-p";
+        std::string path;
+        if (i == 0) {
+            path = "[heap]";
+        } else if (i == 1) {
+            path = "[stack]";
+        } else if (i % 4 == 1) {
+            perms = "r-xp";
+            path = "/usr/lib/" + name + "/lib" + std::to_string(i) + ".so";
+        } else if (i % 4 == 2) {
+            perms = "r--p";
+            path = "/usr/lib/" + name + "/lib" + std::to_string(i - 1) + ".so";
+        }
+        bool anonymous = path.empty() || path[0] == '[';
+        uint64_t size = (uint64_t) pssKb * 1024;
+        snprintf(entry, sizeof(entry),
+                 "%012lx-%012lx %s 00000000 %s                  %s\n"
+                 "Size:           %8d kB\n"
+                 "KernelPageSize:        4 kB\n"
+                 "MMUPageSize:           4 kB\n"
+                 "Rss:            %8d kB\n"
+                 "Pss:            %8d kB\n"
+                 "Pss_Dirty:      %8d kB\n"
+                 "Shared_Clean:          0 kB\n"
+                 "Shared_Dirty:          0 kB\n"
+                 "Private_Clean:  %8d kB\n"
+                 "Private_Dirty:  %8d kB\n"
+                 "Referenced:     %8d kB\n"
+                 "Anonymous:      %8d kB\n"
+                 "LazyFree:              0 kB\n"
+                 "AnonHugePages:         0 kB\n"
+                 "ShmemPmdMapped:        0 kB\n"
+                 "FilePmdMapped:         0 kB\n"
+                 "Shared_Hugetlb:        0 kB\n"
+                 "Private_Hugetlb:       0 kB\n"
+                 "Swap:                  0 kB\n"
+                 "SwapPss:               0 kB\n"
+                 "Locked:                0 kB\n"
+                 "THPeligible:           0\n"
+                 "VmFlags: rd wr mr mw me ac sd\n",
+                 (unsigned long) address, (unsigned long) (address + size), perms,
+                 anonymous ? "00:00 0      " : "08:01 1234567", path.c_str(),
+                 pssKb, pssKb, pssKb, anonymous ? pssKb : 0,
+                 anonymous ? 0 : pssKb, anonymous ? pssKb : 0, pssKb, anonymous ? pssKb : 0);
+        smaps += entry;
+        address += size + 4096;
+    }
+    return smaps;
+}
+
+// What the kernel sums from the smaps above, as one [rollup] mapping.
+static std::string GenerateSmapsRollup(int mappings, int pssKb) {
+    int anonymous = 0;
+    for (int i = 0; i < mappings; i++) {
+        anonymous += i < 2 || i % 4 == 0 || i % 4 == 3;
+    }
+    uint64_t totalKb = (uint64_t) mappings * pssKb;
+    uint64_t anonKb = (uint64_t) anonymous * pssKb;
+    char rollup[1024];
+    snprintf(rollup, sizeof(rollup),
+             "555555554000-7ffffffff000 ---p 00000000 00:00 0                          [rollup]\n"
+             "Rss:            %8lu kB\n"
+             "Pss:            %8lu kB\n"
+             "Pss_Dirty:      %8lu kB\n"
+             "Pss_Anon:       %8lu kB\n"
+             "Pss_File:       %8lu kB\n"
+             "Pss_Shmem:             0 kB\n"
+             "Shared_Clean:          0 kB\n"
+             "Shared_Dirty:          0 kB\n"
+             "Private_Clean:  %8lu kB\n"
+             "Private_Dirty:  %8lu kB\n"
+             "Referenced:     %8lu kB\n"
+             "Anonymous:      %8lu kB\n"
+             "LazyFree:              0 kB\n"
+             "AnonHugePages:         0 kB\n"
+             "ShmemPmdMapped:        0 kB\n"
+             "FilePmdMapped:         0 kB\n"
+             "Shared_Hugetlb:        0 kB\n"
+             "Private_Hugetlb:       0 kB\n"
+             "Swap:                  0 kB\n"
+             "SwapPss:               0 kB\n"
+             "Locked:                0 kB\n",
+             (unsigned long) totalKb, (unsigned long) totalKb, (unsigned long) anonKb, (unsigned long) anonKb,
+             (unsigned long) (totalKb - anonKb), (unsigned long) (totalKb - anonKb), (unsigned long) anonKb,
+             (unsigned long) totalKb, (unsigned long) anonKb);
+    return rollup;
+}
+
+static void CloseIfOpen(int fd) {
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+// Rewrites a memfd in place. Contents shorter than the file (e.g. after an
+// exec to a shorter name) are padded before their final newline, so a reader
+// never sees a truncated file.
+static void Rewrite(int fd, size_t *size, std::string contents) {
+    if (contents.size() < *size) {
+        contents.insert(contents.size() - 1, *size - contents.size(), ' ');
+    }
+    if (pwrite(fd, contents.data(), contents.size(), 0) != (ssize_t) contents.size()) {
+        perror("Cannot write memfd");
+        exit(EXIT_FAILURE);
+    }
+    *size = contents.size();
+}
+
+static std::string FormatIo(const IoCounters &io) {
+    char buff[512];
+    snprintf(buff, sizeof(buff),
+             "rchar: %lu\nwchar: %lu\nsyscr: %lu\nsyscw: %lu\nread_bytes: %lu\nwrite_bytes: %lu\n"
+             "cancelled_write_bytes: 0\n",
+             (unsigned long) io.rchar, (unsigned long) io.wchar, (unsigned long) io.syscr,
+             (unsigned long) io.syscw, (unsigned long) io.readBytes, (unsigned long) io.writeBytes);
+    return buff;
+}
+
+SyntheticSource::SyntheticSource(const char *scenarioPath) {
+    Parse(scenarioPath);
+    running = std::make_unique<std::atomic<int>[]>(numPids);
+    for (int pid = 0; pid < numPids; pid++) {
+        running[pid] = -1;
+    }
+    running[kRootPid] = 0;
+    counters[kRootPid] = {.parent = 0, .lastStep = 0};
+    alivePositions.assign(numPids, -1);
+}
+
+SyntheticSource::~SyntheticSource() {
+    if (replay.joinable()) {
+        replay.join();
+    }
+    for (const auto &[pid, process]: counters) {
+        CloseIfOpen(process.statFd);
+        CloseIfOpen(process.ioFd);
+    }
+    for (const auto &[pid, space]: addressSpaces) {
+        CloseIfOpen(space.smaps);
+        CloseIfOpen(space.smapsRollup);
+    }
+}
+
+void SyntheticSource::AddProgram(const std::string &name, int mappings, int pssKb) {
+    programs.push_back({name,
+                        mappings,
+                        pssKb,
+                        GenerateSmaps(name, mappings, pssKb),
+                        GenerateSmapsRollup(mappings, pssKb)});
+}
+
+void SyntheticSource::Parse(const char *scenarioPath) {
+    FILE *f = fopen(scenarioPath, "r");
+    if (!f) {
+        perror("Cannot open scenario");
+        exit(EXIT_FAILURE);
+    }
+
+    auto fail = [&](int lineNumber, const char *error) {
+        fprintf(stderr, "%s:%d: %s\n", scenarioPath, lineNumber, error);
+        exit(EXIT_FAILURE);
+    };
+    auto findProgram = [&](const char *name) {
+        for (size_t i = 0; i < programs.size(); i++) {
+            if (programs[i].name == name) {
+                return (int) i;
+            }
+        }
+        return -1;
+    };
+
+    auto usePid = [&](int pid) {
+        numPids = std::max(numPids, pid + 1);
+    };
+
+    char line[1024];
+    int lineNumber = 0;
+    uint64_t randomPids = 0;
+    while (fgets(line, sizeof(line), f) != nullptr) {
+        lineNumber++;
+        char keyword[64];
+        char name[256];
+        int a, b;
+        unsigned seed;
+        if (sscanf(line, "%63s", keyword) != 1 || keyword[0] == '#') {
+            continue;
+        }
+        if (strcmp(keyword, "program") == 0) {
+            if (sscanf(line, "%*s %255s %d %d", name, &a, &b) != 3 || a < 0 || b < 0) {
+                fail(lineNumber, "expected 'program NAME MAPPINGS PSS_KB'");
+            }
+            if (findProgram(name) >= 0) {
+                fail(lineNumber, "program defined twice");
+            }
+            AddProgram(name, a, b);
+        } else if (strcmp(keyword, "fork") == 0) {
+            if (sscanf(line, "%*s %d %d", &a, &b) != 2 || a < kRootPid || b <= kRootPid) {
+                fail(lineNumber, "expected 'fork PARENT CHILD', CHILD > 1");
+            }
+            steps.push_back({FORK, b, a, 0});
+            usePid(a);
+            usePid(b);
+        } else if (strcmp(keyword, "exec") == 0) {
+            if (sscanf(line, "%*s %d %255s", &a, name) != 2 || a < kRootPid) {
+                fail(lineNumber, "expected 'exec PID NAME'");
+            }
+            if ((b = findProgram(name)) < 0) {
+                fail(lineNumber, "unknown program");
+            }
+            steps.push_back({EXEC, a, b, 0});
+            usePid(a);
+        } else if (strcmp(keyword, "exit") == 0) {
+            if (sscanf(line, "%*s %d", &a) != 1 || a <= kRootPid) {
+                fail(lineNumber, "expected 'exit PID', PID > 1");
+            }
+            steps.push_back({EXIT, a, 0, 0});
+            usePid(a);
+        } else if (strcmp(keyword, "random") == 0) {
+            if (sscanf(line, "%*s %d %d %u", &a, &b, &seed) != 3 || a < 0 || b < 1) {
+                fail(lineNumber, "expected 'random PROCESSES LIVE SEED', LIVE > 0");
+            }
+            steps.push_back({RANDOM, a, b, seed});
+            randomPids += a;
+        } else {
+            fail(lineNumber, "unknown keyword");
+        }
+        if (programs.empty()) {
+            fail(lineNumber, "the root program must come first");
+        }
+    }
+    fclose(f);
+
+    if (programs.empty()) {
+        fail(lineNumber, "no program");
+    }
+    // Random processes get the pids after the scripted ones.
+    if (numPids + randomPids > INT32_MAX / 2) {
+        fail(lineNumber, "too many processes");
+    }
+    numPids += randomPids;
+}
+
+int SyntheticSource::RootPid() const {
+    return kRootPid;
+}
+
+std::string SyntheticSource::RootCmdline() const {
+    return programs[0].name;
+}
+
+void SyntheticSource::Start() {
+    if (replay.joinable()) {
+        fprintf(stderr, "A synthetic source replays its scenario once\n");
+        exit(EXIT_FAILURE);
+    }
+    replay = std::thread(&SyntheticSource::Replay, this);
+}
+
+ProcessEventSource::Subscription *SyntheticSource::Subscribe() {
+    return router.Subscribe();
+}
+
+// A replay blocked on the full queue of the subscription gives up, and the
+// replay stops at the next step once nobody reads the rest of the scenario.
+void SyntheticSource::Unsubscribe(Subscription *subscription) {
+    router.Unsubscribe(subscription);
+}
+
+void SyntheticSource::AddRoot(Subscription *subscription, int pid) {
+    router.AddRoot(subscription, pid);
+}
+
+uint64_t SyntheticSource::Overruns() const {
+    return 0;
+}
+
+// Grows the counters by the steps since they last grew, in proportion to the
+// size of the program: a step stands for a clock tick of CPU time.
+void SyntheticSource::Grow(ProcessCounters *process, int program) const {
+    uint64_t steps = step - process->lastStep;
+    process->lastStep = step;
+    if (program < 0) {
+        return;
+    }
+    uint64_t mappings = programs[program].mappings;
+    process->minorFaults += steps * mappings;
+    process->userTicks += steps * (1 + mappings / 64);
+    process->sysTicks += steps;
+    process->io.rchar += steps * mappings * 4096;
+    process->io.wchar += steps * mappings * 512;
+    process->io.syscr += steps * mappings;
+    process->io.syscw += steps * (1 + mappings / 4);
+    process->io.readBytes += steps * mappings * 1024;
+    process->io.writeBytes += steps * mappings * 256;
+}
+
+std::string SyntheticSource::FormatStat(int pid, int program, const ProcessCounters &process) const {
+    const Program &p = programs[program];
+    char stat[512];
+    snprintf(stat, sizeof(stat),
+             "%d (%s) R %d 1 1 0 -1 4194304 %lu 0 0 0 %lu %lu %lu %lu 20 0 1 0 100 %lu %d\n",
+             pid, p.name.c_str(), process.parent, (unsigned long) process.minorFaults,
+             (unsigned long) process.userTicks, (unsigned long) process.sysTicks,
+             (unsigned long) process.childrenUserTicks, (unsigned long) process.childrenSysTicks,
+             (unsigned long) p.mappings * p.pssKb * 1024, p.mappings * p.pssKb / 4);
+    return stat;
+}
+
+// Only the files handed out are kept up to date, the others are generated
+// when first opened.
+void SyntheticSource::WriteCounters(int pid, int program, ProcessCounters *process) const {
+    if (program < 0) {
+        return;
+    }
+    if (process->statFd >= 0) {
+        Rewrite(process->statFd, &process->statSize, FormatStat(pid, program, *process));
+    }
+    if (process->ioFd >= 0) {
+        Rewrite(process->ioFd, &process->ioSize, FormatIo(process->io));
+    }
+}
+
+// Every event is a step. Processes which live through steps without an event
+// of their own are brought up to date every kCountersRefreshUs.
+void SyntheticSource::NextStep() {
+    step++;
+    uint64_t now = GetTimeUs();
+    if (now - lastRefreshUs < kCountersRefreshUs) {
+        return;
+    }
+    lastRefreshUs = now;
+    std::lock_guard<std::mutex> lock(countersMutex);
+    for (auto &[pid, process]: counters) {
+        int program = ProgramOf(pid);
+        Grow(&process, program);
+        WriteCounters(pid, program, &process);
+    }
+}
+
+void SyntheticSource::Fork(int parent, int child) {
+    NextStep();
+    {
+        std::lock_guard<std::mutex> lock(countersMutex);
+        if (auto it = counters.find(child); it != counters.end()) {
+            CloseIfOpen(it->second.statFd);
+            CloseIfOpen(it->second.ioFd);
+        }
+        counters[child] = {.parent = parent, .lastStep = step};
+    }
+    {
+        std::lock_guard<std::mutex> lock(smapsMutex);
+        DropAddressSpace(child);
+        running[child].store(running[parent].load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+    if (alivePositions[child] < 0) {
+        alivePositions[child] = (int) alive.size();
+        alive.push_back(child);
+    }
+    proc_event event{};
+    event.what = proc_event::PROC_EVENT_FORK;
+    event.timestamp_ns = GetTimeNs();
+    event.event_data.fork = {parent, parent, child, child};
+    router.Route(event);
+}
+
+void SyntheticSource::DropAddressSpace(int pid) {
+    auto it = addressSpaces.find(pid);
+    if (it == addressSpaces.end()) {
+        return;
+    }
+    for (int fd: {it->second.smaps, it->second.smapsRollup}) {
+        if (fd >= 0 && ftruncate(fd, 0) == -1) {
+            perror("Cannot truncate memfd");
+            exit(EXIT_FAILURE);
+        }
+        CloseIfOpen(fd);
+    }
+    addressSpaces.erase(it);
+}
+
+void SyntheticSource::Exec(int pid, int program) {
+    NextStep();
+    {
+        // Counters survive the exec, and grow at the rate of the new program
+        // from now on. The next refresh writes them.
+        std::lock_guard<std::mutex> lock(countersMutex);
+        if (auto it = counters.find(pid); it != counters.end()) {
+            Grow(&it->second, ProgramOf(pid));
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(smapsMutex);
+        DropAddressSpace(pid);
+        running[pid].store(program, std::memory_order_relaxed);
+    }
+    proc_event event{};
+    event.what = proc_event::PROC_EVENT_EXEC;
+    event.timestamp_ns = GetTimeNs();
+    event.event_data.exec = {pid, pid};
+    router.Route(event);
+}
+
+void SyntheticSource::Exit(int pid) {
+    NextStep();
+    {
+        // The final values, then the times of the process and of its reaped
+        // children add to the children times of its parent, written at the
+        // next refresh.
+        std::lock_guard<std::mutex> lock(countersMutex);
+        if (auto it = counters.find(pid); it != counters.end()) {
+            ProcessCounters &process = it->second;
+            Grow(&process, ProgramOf(pid));
+            WriteCounters(pid, ProgramOf(pid), &process);
+            if (auto parent = counters.find(process.parent); parent != counters.end()) {
+                parent->second.childrenUserTicks += process.userTicks + process.childrenUserTicks;
+                parent->second.childrenSysTicks += process.sysTicks + process.childrenSysTicks;
+            }
+            CloseIfOpen(process.statFd);
+            CloseIfOpen(process.ioFd);
+            counters.erase(it);
+        }
+    }
+    if (int position = alivePositions[pid]; position >= 0) {
+        alive[position] = alive.back();
+        alivePositions[alive[position]] = position;
+        alive.pop_back();
+        alivePositions[pid] = -1;
+    }
+    {
+        std::lock_guard<std::mutex> lock(smapsMutex);
+        DropAddressSpace(pid);
+        running[pid].store(-1, std::memory_order_relaxed);
+    }
+    proc_event event{};
+    event.what = proc_event::PROC_EVENT_EXIT;
+    event.timestamp_ns = GetTimeNs();
+    event.event_data.exit.process_pid = pid;
+    event.event_data.exit.process_tgid = pid;
+    router.Route(event);
+}
+
+void SyntheticSource::Replay() {
+    int nextRandomPid = numPids;
+    for (const Step &step: steps) {
+        if (step.type == RANDOM) {
+            nextRandomPid -= step.pid;
+        }
+    }
+
+    for (const Step &step: steps) {
+        if (router.Empty()) {
+            return;
+        }
+        switch (step.type) {
+            case FORK:
+                Fork(step.other, step.pid);
+                break;
+            case EXEC:
+                Exec(step.pid, step.other);
+                break;
+            case EXIT:
+                Exit(step.pid);
+                break;
+            case RANDOM: {
+                // Seeded, so a scenario replays the same tree every time.
+                std::mt19937 random(step.seed);
+                for (int i = 0; i < step.pid && !router.Empty(); i++) {
+                    while ((int) alive.size() >= step.other) {
+                        Exit(alive[random() % alive.size()]);
+                    }
+                    size_t parent = random() % (alive.size() + 1);
+                    int child = nextRandomPid++;
+                    Fork(parent == alive.size() ? kRootPid : alive[parent], child);
+                    Exec(child, (int) (random() % programs.size()));
+                }
+                break;
+            }
+        }
+    }
+
+    while (!alive.empty()) {
+        Exit(alive.back());
+    }
+    Exit(kRootPid);
+}
+
+int SyntheticSource::ProgramOf(int pid) const {
+    if (pid < 0 || pid >= numPids) {
+        return -1;
+    }
+    return running[pid].load(std::memory_order_relaxed);
+}
+
+std::string SyntheticSource::ReadCmdline(int pid) {
+    int program = ProgramOf(pid);
+    return program < 0 ? "" : programs[program].name;
+}
+
+static int Dup(int fd) {
+    return fcntl(fd, F_DUPFD_CLOEXEC, 0);
+}
+
+int SyntheticSource::OpenIo(int pid) {
+    std::lock_guard<std::mutex> lock(countersMutex);
+    auto it = counters.find(pid);
+    if (ProgramOf(pid) < 0 || it == counters.end()) {
+        return -1;
+    }
+    ProcessCounters &process = it->second;
+    if (process.ioFd < 0) {
+        std::string io = FormatIo(process.io);
+        process.ioFd = WriteMemfd("io", io);
+        process.ioSize = io.size();
+    }
+    return Dup(process.ioFd);
+}
+
+int SyntheticSource::OpenStat(int pid) {
+    std::lock_guard<std::mutex> lock(countersMutex);
+    int program = ProgramOf(pid);
+    auto it = counters.find(pid);
+    if (program < 0 || it == counters.end()) {
+        return -1;
+    }
+    ProcessCounters &process = it->second;
+    if (process.statFd < 0) {
+        std::string stat = FormatStat(pid, program, process);
+        process.statFd = WriteMemfd("stat", stat);
+        process.statSize = stat.size();
+    }
+    return Dup(process.statFd);
+}
+
+int SyntheticSource::OpenAddressSpaceFile(int pid, int AddressSpace::*fd, std::string Program::*contents) {
+    std::lock_guard<std::mutex> lock(smapsMutex);
+    int program = ProgramOf(pid);
+    if (program < 0) {
+        return -1;
+    }
+    AddressSpace &space = addressSpaces[pid];
+    if (space.*fd < 0) {
+        space.*fd = WriteMemfd("smaps", programs[program].*contents);
+    }
+    return Dup(space.*fd);
+}
+
+int SyntheticSource::OpenSmaps(int pid) {
+    return OpenAddressSpaceFile(pid, &AddressSpace::smaps, &Program::smaps);
+}
+
+int SyntheticSource::OpenSmapsRollup(int pid) {
+    return OpenAddressSpaceFile(pid, &AddressSpace::smapsRollup, &Program::smapsRollup);
+}
+
+// No pressure in a made-up system.
+int SyntheticSource::OpenPressure(PsiResource, bool) {
+    return -1;
+}
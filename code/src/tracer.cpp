@@ -0,0 +1,324 @@
+#include "tracer.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+// Fork a child which waits on a pipe before exec'ing argv, so the parent can
+// attach perf counters and routes to it first. Writing to *releaseFd (or
+// closing it) lets it go.
+static int Spawn(char **argv, int *releaseFd) {
+    Log("ForkAndExec %s\n", argv[0]);
+
+    int ready[2];
+    if (pipe2(ready, O_CLOEXEC) == -1) {
+        perror("Cannot create pipe");
+        exit(EXIT_FAILURE);
+    }
+
+    int pid = fork();
+    if (pid == -1) {
+        perror("Cannot fork");
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0) { // This is the new process
+        // Drop superuser privileges
+        DropRoot();
+
+        close(ready[1]);
+        char go;
+        if (read(ready[0], &go, 1) != 1) {
+            exit(EXIT_FAILURE);
+        }
+        close(ready[0]);
+
+        int ret = execvp(argv[0], argv);
+        if (ret == -1) {
+            Log("Could not execv '%s'", argv[0]);
+            perror("Unable to execv");
+            exit(EXIT_FAILURE);
+        }
+    }
+    close(ready[0]);
+    *releaseFd = ready[1];
+    return pid;
+}
+
+Tracer::Tracer(ProcessEventSource &source, const TracerOptions &options)
+        : source(source), subscription(source.Subscribe()), options(options),
+          proc(options.proc ? *options.proc : SystemProc()) {
+    sampler = std::make_unique<Sampler>(options.sampler, options.perfCounters ? &perf : nullptr, proc);
+    sampler->SetSampleHandler([this](const Event &event) {
+        trace.events.push_back(event);
+        if (onSample && event.type != FORK && event.type != EXIT) {
+            onSample(event);
+        }
+    });
+
+    // The aggregator (the thread calling Poll) owns the trace, and is woken up
+    // by the netlink and the sampler queues.
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1) {
+        perror("Cannot create epoll");
+        exit(EXIT_FAILURE);
+    }
+    for (int fd: {subscription->EventsFd(), sampler->SamplesFd()}) {
+        struct epoll_event ev{};
+        ev.data.fd = fd;
+        ev.events = EPOLLIN; // Register for read availability
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)) {
+            perror("epoll_ctl error");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+// Abandons a trace which was not stopped, e.g. on an error path of a test
+// harness: the root we started is killed instead of waited for, and the sinks
+// get nothing.
+Tracer::~Tracer() {
+    if (running) {
+        if (spawned) {
+            kill(trace.pid, SIGKILL);
+            waitpid(trace.pid, nullptr, 0);
+        }
+        sampler->SetSampleHandler([](const Event &) {});
+        sampler->Stop();
+        running = false;
+    }
+    Unsubscribe();
+    close(epfd);
+}
+
+void Tracer::AddSink(TraceSink *sink) {
+    sinks.push_back(sink);
+}
+
+int Tracer::Start(char **argv) {
+    int releaseFd;
+    int pid = Spawn(argv, &releaseFd);
+    spawned = true;
+    if (options.perfCounters) {
+        perf.Open(pid);
+    }
+    // For short-lived process, we may not be quick enough to poll /proc/PID/cmdline.
+    // We cheat and pre-populate the cache here.
+    std::string cmdline;
+    for (char **arg = argv; *arg; arg++) {
+        cmdline += " ";
+        cmdline += *arg;
+    }
+    Attach(pid, cmdline);
+
+    if (write(releaseFd, "g", 1) != 1) {
+        perror("Cannot start child");
+    }
+    close(releaseFd);
+    return pid;
+}
+
+void Tracer::Attach(int pid, const std::string &cmdline) {
+    sampler->Start();
+    running = true;
+
+    trace.startTimeMs = GetTimeMs();
+    source.AddRoot(subscription, pid);
+    trace.pid = pid;
+    trace.numProcesses = 1;
+    trace.numThreads = 1;
+    Track(pid, 0);
+    Declare(trace.cmdlines, pid, cmdline);
+}
+
+int Tracer::Fd() const {
+    return epfd;
+}
+
+bool Tracer::Poll(int timeoutMs) {
+    if (!Tracked(trace.pid)) {
+        return false;
+    }
+
+    const int kMaxEvents = 2;
+    struct epoll_event evlist[kMaxEvents];
+    int ready = epoll_wait(epfd, evlist, kMaxEvents, timeoutMs);
+    if (ready == -1) {
+        if (errno == EINTR) {
+            return true;
+        }
+        perror("epoll error");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int j = 0; j < ready; j++) {
+        if (evlist[j].data.fd == subscription->EventsFd()) {
+            HandleProcEvents();
+        } else {
+            HandleSamples();
+        }
+    }
+    if (!Tracked(trace.pid)) {
+        // Nobody drains the events of the orphans left behind anymore.
+        Unsubscribe();
+        return false;
+    }
+    return true;
+}
+
+void Tracer::Unsubscribe() {
+    if (!subscription) {
+        return;
+    }
+    subscriptionStats = subscription->Stats();
+    epoll_ctl(epfd, EPOLL_CTL_DEL, subscription->EventsFd(), nullptr);
+    source.Unsubscribe(subscription);
+    subscription = nullptr;
+}
+
+const Trace &Tracer::Stop() {
+    // Let's RIP the cmd process and gather some stats
+    if (spawned && wait4(trace.pid, &trace.status, 0, &trace.usage) < 0) {
+        perror("Could not wait4");
+        exit(EXIT_FAILURE);
+    }
+    trace.endTimeMs = GetTimeMs();
+    Unsubscribe();
+
+    sampler->Stop();
+    HandleSamples();
+    running = false;
+
+    if (perf.IsOpen()) {
+        trace.perfAvailable = true;
+        for (int counter = 0; counter < PERF_COUNT; counter++) {
+            trace.perfAvailable &= perf.Read((PerfCounter) counter, &trace.perfTotals[counter]);
+        }
+        perf.Close();
+    }
+    trace.triggeredSamples = sampler->NumTriggeredSamples();
+    trace.throttledSamples = sampler->NumThrottledSamples();
+    trace.clock = sampler->GetClockStats();
+    trace.hotPaths = sampler->GetHotPathStats();
+    trace.breakdown = sampler->GetBreakdownStats();
+    trace.queues = {subscriptionStats, sampler->CommandStats(), sampler->OutputStats()};
+    trace.netlinkOverruns = source.Overruns();
+
+    for (TraceSink *sink: sinks) {
+        sink->Write(trace);
+    }
+    return trace;
+}
+
+const Trace &Tracer::GetTrace() const {
+    return trace;
+}
+
+// Fork and exit events are recorded by the sampler, so they are ordered with
+// the samples of their pid.
+void Tracer::Track(int pid, int parent) {
+    trackedPids.insert(pid);
+    sampler->Track(pid, parent);
+}
+
+void Tracer::Untrack(int pid) {
+    if (trackedPids.erase(pid)) {
+        sampler->Untrack(pid);
+        if (onExit) {
+            onExit(pid);
+        }
+    }
+}
+
+bool Tracer::Tracked(int pid) const {
+    return trackedPids.contains(pid);
+}
+
+void Tracer::HandleSamples() {
+    sampler->HandleSamples();
+}
+
+void Tracer::HandleProcEvents() {
+    subscription->ClearNotify();
+    proc_event ev;
+    while (subscription->Pop(&ev)) {
+        trace.procEvents++;
+        switch (ev.what) {
+            case proc_event::PROC_EVENT_FORK:
+                OnFork(ev);
+                break;
+            case proc_event::PROC_EVENT_EXEC:
+                OnExec(ev);
+                break;
+            case proc_event::PROC_EVENT_EXIT:
+                OnExit(ev);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+// The event source only routes us events of our tree, the root included.
+void Tracer::OnFork(const proc_event &ev) {
+    const auto &fork = ev.event_data.fork;
+    if (fork.child_pid != fork.child_tgid) {
+        // This is a new thread
+        if (Tracked(fork.child_tgid)) {
+            trace.numThreads++;
+            Log("%s:parent(pid,tgid)=%d,%d\tchild(pid,tgid)=%d,%d\n",
+                "NEW_THREAD ", fork.parent_pid, fork.parent_tgid, fork.child_pid, fork.child_tgid);
+        }
+        return;
+    }
+
+    // This is a new process. The root was tracked by Start().
+    if (!Tracked(fork.parent_tgid) || Tracked(fork.child_tgid)) {
+        return;
+    }
+    trace.numThreads++;
+    trace.numProcesses++;
+    Log("%s:parent(pid,tgid)=%d,%d\tchild(pid,tgid)=%d,%d\n",
+        "NEW_PROCESS ", fork.parent_pid, fork.parent_tgid, fork.child_pid, fork.child_tgid);
+    Track(fork.child_tgid, fork.parent_tgid);
+    // Until it execs, the child runs the parent's command
+    Declare(trace.cmdlines, fork.child_tgid, GetCmdline(trace.cmdlines, proc, fork.parent_tgid));
+    sampler->RequestSample(fork.child_tgid, false);
+    if (onFork) {
+        onFork(fork.child_tgid, fork.parent_tgid);
+    }
+}
+
+void Tracer::OnExec(const proc_event &ev) {
+    int pid = ev.event_data.exec.process_pid;
+    if (!Tracked(pid)) {
+        return;
+    }
+
+    std::string cmdline = proc.ReadCmdline(pid);
+    if (cmdline.empty()) {
+        // Already gone, keep what we knew
+        cmdline = GetCmdline(trace.cmdlines, proc, pid);
+    } else {
+        Declare(trace.cmdlines, pid, cmdline);
+    }
+    if (onExec) {
+        onExec(pid, cmdline);
+    }
+    sampler->RequestSample(pid, true);
+}
+
+void Tracer::OnExit(const proc_event &ev) {
+    Log("EXIT:pid=%d, tgid=%d\texit code=%d\n",
+        ev.event_data.exit.process_pid,
+        ev.event_data.exit.process_tgid,
+        ev.event_data.exit.exit_code);
+    Untrack(ev.event_data.exit.process_pid);
+}
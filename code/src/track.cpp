@@ -1,94 +1,312 @@
 #include "track.h"
 
+#include <algorithm>
+#include <functional>
 #include <unordered_set>
 #include <unordered_map>
 
-#include "utils.h"
 #include "proc.h"
 
-std::vector<Event> events;
+// Periodic samples are summed per snapshot. A triggered sample gets its own
+// point, at its own timestamp: its value plus the last periodic values of the
+// other processes alive then. Exited processes are never counted, so two
+// short-lived processes which never coexisted are never summed.
+std::vector<std::pair<uint64_t, uint64_t>> GetCombinedPss(const std::vector<Event> &events) {
+    std::vector<std::pair<uint64_t, uint64_t>> combined;
+    std::unordered_map<int, uint64_t> lastPeriodic; // Alive processes only
+    uint64_t periodicTotal = 0;                     // Sum of lastPeriodic
+    uint64_t lastTick = 0;
 
-int numThread = 0;
-int numProcesses = 0;
-
-std::unordered_set<int> trackedPids;
+    for (const auto &event: events) {
+        switch (event.type) {
+            case PSS: {
+                auto last = lastPeriodic.find(event.pss.pid);
+                uint64_t previous = last == lastPeriodic.end() ? 0 : last->second;
+                if (event.triggered) {
+                    combined.emplace_back(event.timestamp, periodicTotal - previous + event.pss.value);
+                    break;
+                }
+                if (event.tick != lastTick) {
+                    lastTick = event.tick;
+                    combined.emplace_back(event.timestamp, 0);
+                }
+                combined.back().second += event.pss.value;
+                periodicTotal += event.pss.value - previous;
+                lastPeriodic[event.pss.pid] = event.pss.value;
+                break;
+            }
+            case EXIT:
+                if (auto last = lastPeriodic.find(event.process.pid); last != lastPeriodic.end()) {
+                    periodicTotal -= last->second;
+                    lastPeriodic.erase(last);
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    return combined;
+}
 
-static void DumpTrack(const char *prefix) {
-    Log("%s Tracking pids = {", prefix);
-    int i = 0;
-    for (const int &pid: trackedPids) {
-        Log("%d", pid);
-        if (i != trackedPids.size() - 1) {
-            Log(", ");
+long GetMaxCombinedPss(const std::vector<Event> &events) {
+    uint64_t maxPss = 0;
+    for (const auto &pair: GetCombinedPss(events)) {
+        if (maxPss < pair.second) {
+            maxPss = pair.second;
         }
-        i++;
     }
-    Log("} %d process %d threads\n", numProcesses, numThread);
+    return maxPss;
 }
 
-void Track(int pid) {
-    trackedPids.insert(pid);
-    DumpTrack("Add -> ");
+// Each sample, periodic or triggered, holds until the next sample of the same
+// process or its exit. Processes are integrated independently, so triggered
+// samples are weighted by how long they were the latest value.
+std::unordered_map<int, uint64_t> GetPssByteSeconds(const std::vector<Event> &events) {
+    struct Last {
+        uint64_t timestamp;
+        uint64_t value;
+    };
+    std::unordered_map<int, Last> last;
+    std::unordered_map<int, uint64_t> byteMs;
+
+    auto integrate = [&](int pid, uint64_t timestamp) {
+        if (auto it = last.find(pid); it != last.end() && timestamp > it->second.timestamp) {
+            byteMs[pid] += it->second.value * (timestamp - it->second.timestamp);
+        }
+    };
+
+    for (const auto &event: events) {
+        switch (event.type) {
+            case PSS:
+                integrate(event.pss.pid, event.timestamp);
+                last[event.pss.pid] = {event.timestamp, event.pss.value};
+                break;
+            case EXIT:
+                integrate(event.process.pid, event.timestamp);
+                last.erase(event.process.pid);
+                break;
+            default:
+                break;
+        }
+    }
+
+    std::unordered_map<int, uint64_t> byteSeconds;
+    for (const auto &[pid, value]: byteMs) {
+        byteSeconds[pid] = value / 1000;
+    }
+    return byteSeconds;
 }
 
-void Untrack(int pid) {
-    trackedPids.erase(pid);
-    DumpTrack("Rmv -> ");
+static void AddIo(IoCounters *to, const IoCounters &from) {
+    to->rchar += from.rchar;
+    to->wchar += from.wchar;
+    to->syscr += from.syscr;
+    to->syscw += from.syscw;
+    to->readBytes += from.readBytes;
+    to->writeBytes += from.writeBytes;
 }
 
-bool Tracked(int pid) {
-    return trackedPids.contains(pid);
+// whole - children, field by field.
+static IoCounters SelfIo(const IoCounters &whole, const IoCounters &children) {
+    auto sub = [](uint64_t whole, uint64_t children) {
+        return whole > children ? whole - children : 0;
+    };
+    return {sub(whole.rchar, children.rchar),
+            sub(whole.wchar, children.wchar),
+            sub(whole.syscr, children.syscr),
+            sub(whole.syscw, children.syscw),
+            sub(whole.readBytes, children.readBytes),
+            sub(whole.writeBytes, children.writeBytes)};
 }
 
-long GetMaxCombinedPss() {
-    std::unordered_map<uint64_t , uint64_t> psss;
+static void ForEachSelfIo(const std::vector<Event> &events,
+                          const std::function<void(const Event &, const IoCounters &)> &callback) {
+    std::unordered_map<int, int> parents;
+    std::unordered_map<int, IoCounters> self;
+    std::unordered_map<int, IoCounters> reapedChildren;
+
     for (const auto &event: events) {
         switch (event.type) {
-            case PSS:
-                if (!psss.contains(event.timestamp)) {
-                    psss[event.timestamp] = 0;
+            case FORK:
+                parents[event.process.pid] = event.process.parent;
+                break;
+            case EXIT:
+                if (auto parent = parents.find(event.process.pid); parent != parents.end()) {
+                    AddIo(&reapedChildren[parent->second], self[event.process.pid]);
+                    AddIo(&reapedChildren[parent->second], reapedChildren[event.process.pid]);
                 }
-                psss[event.timestamp] = psss[event.timestamp] +  event.pss.value;
                 break;
+            case IO: {
+                IoCounters &counters = self[event.io.pid];
+                counters = SelfIo(event.io.counters, reapedChildren[event.io.pid]);
+                callback(event, counters);
+                break;
+            }
             default:
                 break;
         }
-
     }
+}
 
-    long maxPss = 0;
-    for(auto pair: psss) {
-        if (maxPss < pair.second) {
-            maxPss = pair.second;
+// A child's exit can be accounted before its parent's counters include it:
+// the self I/O of the parent then dips until the reap shows up. Only bytes
+// above the highest self I/O seen for a process are new transfers, so the
+// series sums to the totals instead of counting the recovery twice.
+std::vector<std::pair<uint64_t, uint64_t>> GetCombinedIo(const std::vector<Event> &events) {
+    std::vector<std::pair<uint64_t, uint64_t>> combined;
+    std::unordered_map<int, uint64_t> highWater;
+    uint64_t lastTick = 0;
+    ForEachSelfIo(events, [&](const Event &event, const IoCounters &counters) {
+        if (event.tick != lastTick) {
+            lastTick = event.tick;
+            combined.emplace_back(event.timestamp, 0);
         }
-    }
-    return maxPss;
+        uint64_t bytes = counters.rchar + counters.wchar;
+        uint64_t &high = highWater[event.io.pid];
+        if (bytes > high) {
+            combined.back().second += bytes - high;
+            high = bytes;
+        }
+    });
+    return combined;
 }
 
-void IncThreads() {
-    numThread++;
+std::unordered_map<int, IoCounters> GetIoTotals(const std::vector<Event> &events) {
+    std::unordered_map<int, IoCounters> totals;
+    ForEachSelfIo(events, [&](const Event &event, const IoCounters &counters) {
+        totals[event.io.pid] = counters;
+    });
+    return totals;
 }
 
-void IncProcesses() {
-    numProcesses++;
+std::vector<std::pair<uint64_t, uint64_t>> GetStalls(const std::vector<Event> &events,
+                                                     PsiResource resource, bool full) {
+    std::vector<std::pair<uint64_t, uint64_t>> stalls;
+    uint64_t last = 0;
+    bool first = true;
+    for (const auto &event: events) {
+        if (event.type != PRESSURE || event.psi.resource != resource) {
+            continue;
+        }
+        uint64_t total = full ? event.psi.pressure.fullUs : event.psi.pressure.someUs;
+        if (!first) {
+            stalls.emplace_back(event.timestamp, total - std::min(total, last));
+        }
+        last = total;
+        first = false;
+    }
+    return stalls;
 }
 
-uint64_t NumThreads() {
-    return numThread;
+// One point per snapshot. The process count follows fork/exit events, which
+// the sampler orders with its samples, so it is exact at each snapshot.
+std::vector<Concurrency> GetConcurrency(const std::vector<Event> &events) {
+    std::vector<Concurrency> concurrency;
+    std::unordered_set<int> alive;
+    uint64_t lastTick = 0;
+    for (const auto &event: events) {
+        switch (event.type) {
+            case FORK:
+                alive.insert(event.process.pid);
+                break;
+            case EXIT:
+                alive.erase(event.process.pid);
+                break;
+            case STAT:
+                // The final STAT of an exiting process is not a snapshot.
+                if (event.triggered) {
+                    break;
+                }
+                if (event.tick != lastTick) {
+                    lastTick = event.tick;
+                    concurrency.push_back({event.timestamp, alive.size(), 0, 0});
+                }
+                concurrency.back().threads += event.stat.stat.numThreads;
+                concurrency.back().runnable += event.stat.stat.state == 'R';
+                break;
+            default:
+                break;
+        }
+    }
+    return concurrency;
 }
 
-uint64_t NumProcs() {
-    return numProcesses;
+// Large processes are not broken down on every snapshot: each process holds
+// its last breakdown until the next one or its exit.
+std::vector<std::pair<uint64_t, uint64_t>> GetCombinedMapping(const std::vector<Event> &events,
+                                                              MappingClass mapping, uint64_t MappingUsage::*field) {
+    std::vector<std::pair<uint64_t, uint64_t>> combined;
+    std::unordered_map<int, uint64_t> last; // Alive processes only
+    uint64_t total = 0;                     // Sum of last
+    uint64_t lastTick = 0;
+    for (const auto &event: events) {
+        if (event.type == EXIT) {
+            if (auto it = last.find(event.process.pid); it != last.end()) {
+                total -= it->second;
+                last.erase(it);
+            }
+            continue;
+        }
+        if (event.type != MAPPING || event.mapping.mapping != mapping) {
+            continue;
+        }
+        if (event.tick != lastTick) {
+            lastTick = event.tick;
+            combined.emplace_back(event.timestamp, 0);
+        }
+        uint64_t &value = last[event.mapping.pid];
+        total += event.mapping.usage.*field - value;
+        value = event.mapping.usage.*field;
+        combined.back().second = total;
+    }
+    return combined;
+}
+
+std::vector<std::pair<uint64_t, uint64_t>> GetPerfDeltas(const std::vector<Event> &events,
+                                                         PerfCounter counter) {
+    std::vector<std::pair<uint64_t, uint64_t>> deltas;
+    uint64_t last = 0;
+    for (const auto &event: events) {
+        if (event.type != PERF || event.perf.counter != counter) {
+            continue;
+        }
+        deltas.emplace_back(event.timestamp, event.perf.value - std::min(event.perf.value, last));
+        last = std::max(last, event.perf.value);
+    }
+    return deltas;
 }
 
+std::vector<std::pair<uint64_t, uint64_t>> GetCombinedFaults(const std::vector<Event> &events) {
+    std::vector<std::pair<uint64_t, uint64_t>> faults;
+    std::unordered_map<int, uint64_t> last;
+    uint64_t lastTick = 0;
+    for (const auto &event: events) {
+        if (event.type != STAT) {
+            continue;
+        }
+        // The final STAT of an exiting process gets a point of its own.
+        if (faults.empty() || event.tick != lastTick) {
+            lastTick = event.tick;
+            faults.emplace_back(event.timestamp, 0);
+        }
+        uint64_t total = event.stat.stat.minorFaults + event.stat.stat.majorFaults;
+        faults.back().second += total - std::min(total, last[event.stat.pid]);
+        last[event.stat.pid] = total;
+    }
+    return faults;
+}
 
-void SnapshotPss() {
-    uint64_t now = GetTimeMs();
-    for (int pid: trackedPids) {
-        uint64_t pss = GetPSS(pid);
-        events.push_back({.timestamp = now,
-                                 .type = PSS,
-                                 .pss = {pid, pss}}
-        );
+std::pair<uint64_t, uint64_t> GetFaultTotals(const std::vector<Event> &events) {
+    std::unordered_map<int, ProcStat> last;
+    for (const auto &event: events) {
+        if (event.type == STAT) {
+            last[event.stat.pid] = event.stat.stat;
+        }
     }
-}
\ No newline at end of file
+    std::pair<uint64_t, uint64_t> totals{0, 0};
+    for (const auto &[pid, stat]: last) {
+        totals.first += stat.minorFaults;
+        totals.second += stat.majorFaults;
+    }
+    return totals;
+}
@@ -10,7 +10,7 @@
 #include <string>
 #include <pwd.h>
 
-uint64_t toMs(struct timeval &val) {
+uint64_t toMs(const struct timeval &val) {
     return val.tv_sec * 1000 + val.tv_usec / 1000;
 }
 
@@ -21,6 +21,20 @@ uint64_t GetTimeMs() {
     return spec.tv_nsec / 1000000 + spec.tv_sec * 1000;
 }
 
+// Return time in microseconds, on the same clock as GetTimeMs.
+uint64_t GetTimeUs() {
+    struct timespec spec;
+    clock_gettime(CLOCK_MONOTONIC, &spec);
+    return spec.tv_nsec / 1000 + spec.tv_sec * 1000000;
+}
+
+// Return time in nanoseconds, on the same clock as GetTimeMs.
+uint64_t GetTimeNs() {
+    struct timespec spec;
+    clock_gettime(CLOCK_MONOTONIC, &spec);
+    return spec.tv_nsec + spec.tv_sec * 1000000000;
+}
+
 static bool kLogEnable = false;
 void Log(const char *fmt, ...) {
     if (!kLogEnable) {
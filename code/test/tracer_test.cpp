@@ -0,0 +1,153 @@
+// Two tracers sharing one event source, each attached to its own tree of a
+// synthetic replay: each must see the events of its tree, and only those.
+// Needs no root. Run with `make test`.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <set>
+#include <string>
+
+#include <unistd.h>
+
+#include "proc.h"
+#include "synthetic.h"
+#include "tracer.h"
+
+// Two trees under pid 1, which nobody traces, and a stray process of pid 1.
+static const char *kScenario =
+        "program init 4 4\n"
+        "program alpha 8 4\n"
+        "program beta 16 4\n"
+        "program gamma 2 4\n"
+        "fork 1 2\n"
+        "fork 1 3\n"
+        "exec 2 alpha\n"
+        "exec 3 beta\n"
+        "fork 2 4\n"
+        "fork 3 5\n"
+        "fork 2 6\n"
+        "exec 4 beta\n"
+        "fork 1 7\n"
+        "exec 7 gamma\n"
+        "exit 4\n"
+        "exit 5\n"
+        "exit 7\n"
+        "exit 6\n"
+        "exit 3\n"
+        "exit 2\n";
+
+static int failures = 0;
+
+static void Check(bool condition, const char *tree, const char *what) {
+    if (!condition) {
+        fprintf(stderr, "FAIL: tree %s: %s\n", tree, what);
+        failures++;
+    }
+}
+
+static std::string WriteScenario() {
+    char path[] = "/tmp/ste_test_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1) {
+        perror("Cannot create scenario");
+        exit(EXIT_FAILURE);
+    }
+    size_t size = strlen(kScenario);
+    if (write(fd, kScenario, size) != (ssize_t) size) {
+        perror("Cannot write scenario");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    return path;
+}
+
+struct Expected {
+    const char *name;
+    int root;
+    std::set<int> pids;
+    // An exec may be handled after the replay moved on, the command is then
+    // the one inherited from the parent.
+    std::set<std::string> commands;
+    uint64_t procEvents;
+};
+
+static void CheckTrace(const Trace &trace, const std::set<int> &forked, const std::set<int> &exited,
+                       const Expected &expected) {
+    const char *tree = expected.name;
+    Check(trace.pid == expected.root, tree, "wrong root");
+    Check(trace.numProcesses == expected.pids.size(), tree, "wrong number of processes");
+    Check(trace.procEvents == expected.procEvents, tree, "wrong number of process events");
+
+    std::set<int> children = expected.pids;
+    children.erase(expected.root);
+    Check(forked == children, tree, "onFork did not report exactly its children");
+    Check(exited == expected.pids, tree, "onExit did not report exactly its processes");
+
+    for (const Event &event: trace.events) {
+        int pid;
+        switch (event.type) {
+            case FORK:
+            case EXIT:
+                pid = event.process.pid;
+                break;
+            case PSS:
+                pid = event.pss.pid;
+                break;
+            case STAT:
+                pid = event.stat.pid;
+                break;
+            default:
+                continue;
+        }
+        Check(expected.pids.contains(pid), tree, "event of a process of another tree");
+    }
+    for (int pid: expected.pids) {
+        Check(expected.commands.contains(GetCommand(trace.cmdlines, pid)), tree, "command of another tree");
+    }
+}
+
+int main() {
+    std::string scenario = WriteScenario();
+    SyntheticSource source(scenario.c_str());
+    unlink(scenario.c_str());
+
+    TracerOptions options;
+    options.proc = &source;
+    options.perfCounters = false;
+
+    Expected expectedA = {"alpha", 2, {2, 4, 6}, {"alpha", "beta"}, 8};
+    Expected expectedB = {"beta", 3, {3, 5}, {"beta"}, 5};
+    std::set<int> forkedA, forkedB, exitedA, exitedB;
+
+    Tracer a(source, options);
+    Tracer b(source, options);
+    a.onFork = [&](int pid, int) { forkedA.insert(pid); };
+    b.onFork = [&](int pid, int) { forkedB.insert(pid); };
+    a.onExit = [&](int pid) { exitedA.insert(pid); };
+    b.onExit = [&](int pid) { exitedB.insert(pid); };
+    a.Attach(expectedA.root, "alpha");
+    b.Attach(expectedB.root, "beta");
+    source.Start();
+
+    // One event loop for both, as a test harness would.
+    bool runningA = true, runningB = true;
+    while (runningA || runningB) {
+        if (runningA) {
+            runningA = a.Poll(10);
+        }
+        if (runningB) {
+            runningB = b.Poll(10);
+        }
+    }
+
+    CheckTrace(a.Stop(), forkedA, exitedA, expectedA);
+    CheckTrace(b.Stop(), forkedB, exitedB, expectedB);
+
+    if (failures) {
+        fprintf(stderr, "%d failure(s)\n", failures);
+        return EXIT_FAILURE;
+    }
+    printf("tracer_test: OK\n");
+    return EXIT_SUCCESS;
+}